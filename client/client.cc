@@ -28,19 +28,25 @@ bool networking_sender_main_worker(NetworkingThreadContext *ctx, NetSock *s) {
   }
 
   while (!ctx->end) {
-    EventGameNet ev;
+    const uint32_t ticket = ctx->wakeup->ticket();
 
-    if (!ctx->queue_game_from->pop(&ev)) {
-      // Nothing to send yet. Sleep a while (a 5ms wake-up lag doesn't matter).
-      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    // Whatever piled up is sent in one go.
+    EventGameNet evs[16];
+    const size_t count = ctx->queue_game_from->pop(evs, 16);
+
+    if (count == 0) {
+      // Nothing to send yet. Sleep until there is (or until the end).
+      ctx->wakeup->wait(ticket, Wakeup::FOREVER);
       continue;
     }
 
-    assert(ev.type == EventGameNet::PACKET);  // Only supported type.
-    std::unique_ptr<PacketsCS> p(ev.packet);
+    for (size_t i = 0; i < count; i++) {
+      assert(evs[i].type == EventGameNet::PACKET);  // Only supported type.
+      std::unique_ptr<PacketsCS> p(evs[i].packet);
 
-    if (!ev.packet->send(s)) {
-      return false;
+      if (!p->send(s)) {
+        return false;
+      }
     }
   }
 
@@ -55,6 +61,7 @@ bool networking_sender_main_worker(NetworkingThreadContext *ctx, NetSock *s) {
 void networking_sender_main(NetworkingThreadContext *ctx, NetSock *s) {
   ctx->return_value &= networking_sender_main_worker(ctx, s);
   ctx->end = true;
+  ctx->main_wakeup->notify();
 }
 
 bool networking_main_worker(NetworkingThreadContext *ctx, NetSock *s) {
@@ -86,6 +93,7 @@ void networking_main(NetworkingThreadContext *ctx) {
     fprintf(stderr, "error: could not connect to game server\n");
     ctx->return_value = false;
     ctx->end = true;
+    ctx->main_wakeup->notify();
     return;
   }
 
@@ -94,36 +102,58 @@ void networking_main(NetworkingThreadContext *ctx) {
   std::thread sender(networking_sender_main, ctx, &s);
   ctx->return_value &= networking_main_worker(ctx, &s);
   ctx->end = true;
+  ctx->wakeup->notify();  // For the sender.
+  ctx->main_wakeup->notify();
 
   ctx->queue_game_to->push(EventNetGame{EventNetGame::DISCONNECT});
 
   sender.join();
 }
 
-void game_main(GameThreadContext *ctx) {
+void game_main(GameThreadContext *ctx, Wakeup *main_wakeup) {
   GameLogic logic;
   logic.main(ctx);
+  main_wakeup->notify();  // So that it notices the end flag.
 }
 
 bool game(const Config *config) {
   // Initialize the game engine before starting the threads.
   Engine e;
+  e.set_quality(find_quality_preset(config->quality));
+  e.set_frame_budget(config->frame_budget_ms);
+  e.set_render_threads(config->render_threads);
   if (!e.initialize()) {
     puts("error: engine initialization failed");
     return false;
   }
 
-  // Queues for cross-thread communication.
+  // Queues for cross-thread communication. Each thread sleeps on its wakeup
+  // until something arrives in one of its queues.
   SyncedQueue<EventGameNet> queue_game_net;
   SyncedQueue<EventNetGame> queue_net_game;
   SyncedQueue<EventGameUI> queue_game_ui;
   SyncedQueue<EventUIGame> queue_ui_game;
 
+  Wakeup net_wakeup;
+  Wakeup game_wakeup;
+  Wakeup main_wakeup;
+  queue_game_net.set_wakeup(&net_wakeup);
+  queue_net_game.set_wakeup(&game_wakeup);
+  queue_ui_game.set_wakeup(&game_wakeup);
+  queue_game_ui.set_wakeup(&main_wakeup);
+
+  // Mouse moves are superseded by the next one anyway, so these are the ones
+  // to go if the game thread falls behind (everything else waits).
+  queue_ui_game.set_overflow_hook([](const EventUIGame& ev) {
+    return ev.type != EventUIGame::MOUSE_MOVE;
+  });
+
   // Prepare the UI context (it might run in this thread synchronously, or in
   // another thread, depending got the UI class).
   UIThreadContext ui_ctx;
   ui_ctx.queue_game_from = &queue_game_ui;
   ui_ctx.queue_game_to = &queue_ui_game;
+  ui_ctx.wakeup = &main_wakeup;
 
   std::unique_ptr<UI> ui;
   if (config->ui_type == "SDL2") {
@@ -149,6 +179,8 @@ bool game(const Config *config) {
   net_ctx.config = config;
   net_ctx.queue_game_from = &queue_game_net;
   net_ctx.queue_game_to = &queue_net_game;
+  net_ctx.wakeup = &net_wakeup;
+  net_ctx.main_wakeup = &main_wakeup;
   std::thread net(networking_main, &net_ctx);
 
   // Prepare and start game thread.
@@ -159,11 +191,14 @@ bool game(const Config *config) {
   game_ctx.queue_net_from = &queue_net_game;
   game_ctx.queue_ui_to = &queue_game_ui;
   game_ctx.queue_ui_from = &queue_ui_game;
-  std::thread game(game_main, &game_ctx);
+  game_ctx.wakeup = &game_wakeup;
+  std::thread game(game_main, &game_ctx, &main_wakeup);
 
   // Run the game until the networking thread or the UI finish it.
   bool ret = true;
   while (true) {
+    const uint32_t ticket = main_wakeup.ticket();
+
     // TODO: call a "handle ui" function with a list of events
     // that are to be translated to game events.
 
@@ -182,9 +217,7 @@ bool game(const Config *config) {
       break;
     }
 
-    if (ui->ok_to_yield()) {
-      std::this_thread::sleep_for(std::chrono::milliseconds(1));
-    }
+    ui->wait(ticket);
   }
 
   // Finish all the threads.
@@ -193,6 +226,8 @@ bool game(const Config *config) {
   net_ctx.end = true;
   game_ctx.end = true;
   ui_ctx.end = true;
+  net_wakeup.notify();
+  game_wakeup.notify();
   ui->join();
   game.join();
   net.join();
@@ -220,6 +255,46 @@ int main(int argc, char **argv) {
     ui_type = "SDL2";
   }
 
+  int render_threads = 1;
+  const char *render_threads_str = getenv("ARCANE_RENDER_THREADS");
+  if (render_threads_str != nullptr) {
+    if (sscanf(render_threads_str, "%i", &render_threads) != 1 ||
+        render_threads < 1 || render_threads > 16) {
+      fprintf(stderr,
+              "error: ARCANE_RENDER_THREADS has to be from 1 to 16.\n");
+      return 2;
+    }
+  }
+
+  // Render the likely next views while idle (turns and a step forward).
+  const char *prerender_str = getenv("ARCANE_PRERENDER");
+  bool prerender = prerender_str != nullptr && strcmp(prerender_str, "0") != 0;
+
+  // Lower presets trade resolution and view distance for frame time.
+  const char *quality = getenv("ARCANE_QUALITY");
+  if (quality == nullptr) {
+    quality = "high";
+  }
+
+  if (find_quality_preset(quality) == nullptr) {
+    fprintf(stderr,
+            "error: ARCANE_QUALITY has to be one of: high, medium, low.\n");
+    return 2;
+  }
+
+  // Render time budget for the 3D view in ms (wall clock). When set, the view
+  // distance adapts to stay within it. Off by default.
+  float frame_budget_ms = 0.0f;
+  const char *frame_budget_str = getenv("ARCANE_FRAME_BUDGET");
+  if (frame_budget_str != nullptr) {
+    if (sscanf(frame_budget_str, "%f", &frame_budget_ms) != 1 ||
+        frame_budget_ms < 0.0f || frame_budget_ms > 1000.0f) {
+      fprintf(stderr,
+              "error: ARCANE_FRAME_BUDGET has to be from 0 to 1000 (ms).\n");
+      return 2;
+    }
+  }
+
   char host_address[256]{};
   uint16_t host_port;
   if (sscanf(host, "%255[^:]:%hu", host_address, &host_port) != 2) {
@@ -246,7 +321,11 @@ int main(int argc, char **argv) {
       ui_type,
       passwd,
       host_address, host_port,
-      player_id
+      player_id,
+      render_threads,
+      prerender,
+      quality,
+      frame_budget_ms
   };
 
   // TODO: reconnect on disconnect
@@ -4,11 +4,16 @@
 
 #define ITEM_NON_EXISTING_ID (0xffffffffffffffffULL)
 
+// Client-side integer handle of a texture (see ImageManager::handle).
+typedef uint32_t texture_handle_t;
+#define TEXTURE_NO_HANDLE (0xffffffffU)
+
 struct SimpleItem {
   uint64_t id = ITEM_NON_EXISTING_ID;
   bool movable = false;
   std::string gfx_id = "";
   std::string name = "";
+  texture_handle_t gfx_handle = TEXTURE_NO_HANDLE;  // Resolved from gfx_id.
 };
 
 struct SimpleMob {
@@ -19,6 +24,7 @@ struct SimpleMob {
   uint16_t pos_y{};
   std::string gfx_id{};
   std::string name{};
+  texture_handle_t gfx_handle = TEXTURE_NO_HANDLE;  // Resolved from gfx_id.
 };
 
 struct SimpleItemList {
@@ -9,9 +9,16 @@
 #include <limits>
 #include <ctime>
 #include <cstdarg>
+#include <functional>
+#include <type_traits>
 #include "engine.h"
 #include "items_helper.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#  include <immintrin.h>
+#  define BLIT_SIMD
+#endif
+
 Canvas::Canvas(SDL_Surface *s) {
   // Convert the surface to a bit-compatible format.
   auto conv = SDL_ConvertSurfaceFormat(s, SDL_PIXELFORMAT_RGBA32, 0);
@@ -20,7 +27,6 @@ Canvas::Canvas(SDL_Surface *s) {
   w = conv->w;
   h = conv->h;
   d.resize(w * h);
-  texel_cache.resize(w * h);
 
   // Copy the data and destroy the temporary surface.
   memcpy(d.data(), conv->pixels, w * h * 4);
@@ -93,19 +99,193 @@ void Canvas::copy(Canvas *src,
   assert(src_x >= 0 && src_y >= 0);
   src_w = std::min(src_w, (int)w - dst_x);
   src_h = std::min(src_h, (int)h - dst_y);
+  if (src_w <= 0 || src_h <= 0) {
+    return;
+  }
 
+  // Rows are contiguous in both canvases.
   for (int j = 0; j < src_h; j++) {
-    for (int i = 0; i < src_w; i++) {
-      const size_t src_idx = i + src_x + (j + src_y) * src->w;
-      const size_t dst_idx = i + dst_x + (j + dst_y) * w;
+    memcpy(&d[dst_x + (j + dst_y) * w],
+           &src->d[src_x + (j + src_y) * src->w],
+           src_w * sizeof(RGBA));
+  }
+}
+
+void Canvas::scale_up(const Canvas *src, int factor) {
+  const unsigned int rows = std::min(h, src->h * factor);
+  const unsigned int cols = std::min(w, src->w * factor);
+
+  // Every source row is stretched once, and then just copied.
+  for (unsigned int j = 0; j < rows; j++) {
+    RGBA *dst_px = &d[j * w];
+    if (j % factor != 0) {
+      memcpy(dst_px, dst_px - w, cols * sizeof(RGBA));
+      continue;
+    }
+
+    const RGBA *src_px = &src->d[(j / factor) * src->w];
+    for (unsigned int i = 0; i < cols; i++) {
+      dst_px[i] = src_px[i / factor];
+    }
+  }
+}
 
-      const RGBA& src_px = src->d[src_idx];
-      RGBA& dst_px = d[dst_idx];
+namespace {
+
+// Blends a row of pixels the old fashioned way. Fully opaque pixels are
+// copied, fully transparent ones are skipped, the rest is blended (the
+// resulting alpha is the max of both). The SIMD kernels below have to give
+// exactly the same results.
+void blend_row_scalar(RGBA *dst, const RGBA *src, int n) {
+  for (int i = 0; i < n; i++) {
+    const RGBA& src_px = src[i];
+    RGBA& dst_px = dst[i];
+    if (src_px.a == 255) {
       dst_px = src_px;
+      continue;
+    }
+
+    if (src_px.a == 0) {
+      continue;
+    }
+
+    dst_px = RGBA{
+      (uint8_t)(((uint32_t)src_px.r * src_px.a + (uint32_t)dst_px.r * (255 - src_px.a)) >> 8),
+      (uint8_t)(((uint32_t)src_px.g * src_px.a + (uint32_t)dst_px.g * (255 - src_px.a)) >> 8),
+      (uint8_t)(((uint32_t)src_px.b * src_px.a + (uint32_t)dst_px.b * (255 - src_px.a)) >> 8),
+      std::max(src_px.a, dst_px.a)
+    };
+  }
+}
+
+#ifdef BLIT_SIMD
+// Note: s * a + d * (255 - a) is at most 255 * 255, so it fits in an unsigned
+// 16-bit lane.
+__attribute__((target("sse2")))
+void blend_row_sse2(RGBA *dst, const RGBA *src, int n) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i alpha_mask = _mm_set1_epi32((int)0xff000000);
+  const __m128i c255 = _mm_set1_epi16(255);
+
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+    const __m128i sa = _mm_and_si128(s, alpha_mask);
+    const __m128i a_zero = _mm_cmpeq_epi32(sa, zero);
+    const __m128i a_full = _mm_cmpeq_epi32(sa, alpha_mask);
+
+    // Sprites are mostly either fully transparent or fully opaque.
+    if (_mm_movemask_epi8(a_zero) == 0xffff) {
+      continue;
+    }
+
+    if (_mm_movemask_epi8(a_full) == 0xffff) {
+      _mm_storeu_si128((__m128i*)(dst + i), s);
+      continue;
+    }
+
+    const __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+
+    const __m128i s_lo = _mm_unpacklo_epi8(s, zero);
+    const __m128i s_hi = _mm_unpackhi_epi8(s, zero);
+    const __m128i d_lo = _mm_unpacklo_epi8(d, zero);
+    const __m128i d_hi = _mm_unpackhi_epi8(d, zero);
+
+    const __m128i a_lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_lo, 0xff), 0xff);
+    const __m128i a_hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s_hi, 0xff), 0xff);
+
+    const __m128i r_lo = _mm_srli_epi16(_mm_add_epi16(
+        _mm_mullo_epi16(s_lo, a_lo),
+        _mm_mullo_epi16(d_lo, _mm_sub_epi16(c255, a_lo))), 8);
+    const __m128i r_hi = _mm_srli_epi16(_mm_add_epi16(
+        _mm_mullo_epi16(s_hi, a_hi),
+        _mm_mullo_epi16(d_hi, _mm_sub_epi16(c255, a_hi))), 8);
+
+    __m128i r = _mm_packus_epi16(r_lo, r_hi);
+    r = _mm_or_si128(_mm_andnot_si128(alpha_mask, r),
+                     _mm_and_si128(alpha_mask, _mm_max_epu8(s, d)));
+    r = _mm_or_si128(_mm_and_si128(a_full, s), _mm_andnot_si128(a_full, r));
+    r = _mm_or_si128(_mm_and_si128(a_zero, d), _mm_andnot_si128(a_zero, r));
+    _mm_storeu_si128((__m128i*)(dst + i), r);
+  }
+
+  blend_row_scalar(dst + i, src + i, n - i);
+}
+
+// Same as the SSE2 version, but 8 pixels at a time (unpacking and packing
+// work within the 128-bit lanes, so the pixel order is preserved).
+__attribute__((target("avx2")))
+void blend_row_avx2(RGBA *dst, const RGBA *src, int n) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i alpha_mask = _mm256_set1_epi32((int)0xff000000);
+  const __m256i c255 = _mm256_set1_epi16(255);
+
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+    const __m256i sa = _mm256_and_si256(s, alpha_mask);
+    const __m256i a_zero = _mm256_cmpeq_epi32(sa, zero);
+    const __m256i a_full = _mm256_cmpeq_epi32(sa, alpha_mask);
+
+    if (_mm256_movemask_epi8(a_zero) == -1) {
+      continue;
+    }
+
+    if (_mm256_movemask_epi8(a_full) == -1) {
+      _mm256_storeu_si256((__m256i*)(dst + i), s);
+      continue;
     }
+
+    const __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+
+    const __m256i s_lo = _mm256_unpacklo_epi8(s, zero);
+    const __m256i s_hi = _mm256_unpackhi_epi8(s, zero);
+    const __m256i d_lo = _mm256_unpacklo_epi8(d, zero);
+    const __m256i d_hi = _mm256_unpackhi_epi8(d, zero);
+
+    const __m256i a_lo = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_lo, 0xff), 0xff);
+    const __m256i a_hi = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(s_hi, 0xff), 0xff);
+
+    const __m256i r_lo = _mm256_srli_epi16(_mm256_add_epi16(
+        _mm256_mullo_epi16(s_lo, a_lo),
+        _mm256_mullo_epi16(d_lo, _mm256_sub_epi16(c255, a_lo))), 8);
+    const __m256i r_hi = _mm256_srli_epi16(_mm256_add_epi16(
+        _mm256_mullo_epi16(s_hi, a_hi),
+        _mm256_mullo_epi16(d_hi, _mm256_sub_epi16(c255, a_hi))), 8);
+
+    __m256i r = _mm256_packus_epi16(r_lo, r_hi);
+    r = _mm256_or_si256(_mm256_andnot_si256(alpha_mask, r),
+                        _mm256_and_si256(alpha_mask, _mm256_max_epu8(s, d)));
+    r = _mm256_blendv_epi8(r, s, a_full);
+    r = _mm256_blendv_epi8(r, d, a_zero);
+    _mm256_storeu_si256((__m256i*)(dst + i), r);
   }
+
+  blend_row_sse2(dst + i, src + i, n - i);
+}
+#endif
+
+typedef void (*BlendRowFunc)(RGBA *dst, const RGBA *src, int n);
+
+BlendRowFunc blend_row_func() {
+  static const BlendRowFunc func = []() -> BlendRowFunc {
+#ifdef BLIT_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return blend_row_avx2;
+    }
+
+    if (__builtin_cpu_supports("sse2")) {
+      return blend_row_sse2;
+    }
+#endif
+    return blend_row_scalar;
+  }();
+  return func;
 }
 
+}  // namespace
+
 void Canvas::blit(Canvas *src,
                  int src_x, int src_y,
                  int dst_x, int dst_y,
@@ -114,29 +294,45 @@ void Canvas::blit(Canvas *src,
   assert(src_x >= 0 && src_y >= 0);
   src_w = std::min(src_w, (int)w - dst_x);
   src_h = std::min(src_h, (int)h - dst_y);
+  if (src_w <= 0 || src_h <= 0) {
+    return;
+  }
 
+  if (src->opaque) {
+    copy(src, src_x, src_y, dst_x, dst_y, src_w, src_h);
+    return;
+  }
+
+  const BlendRowFunc blend_row = blend_row_func();
+  if (src->row_runs_index.empty()) {
+    for (int j = 0; j < src_h; j++) {
+      blend_row(&d[dst_x + (j + dst_y) * w],
+                &src->d[src_x + (j + src_y) * src->w],
+                src_w);
+    }
+    return;
+  }
+
+  // Transparent runs are skipped, opaque ones copied, and only the rest is
+  // actually blended.
   for (int j = 0; j < src_h; j++) {
-    for (int i = 0; i < src_w; i++) {
-      const size_t src_idx = i + src_x + (j + src_y) * src->w;
-      const size_t dst_idx = i + dst_x + (j + dst_y) * w;
-
-      const RGBA& src_px = src->d[src_idx];
-      RGBA& dst_px = d[dst_idx];
-      if (src_px.a == 255) {
-        dst_px = src_px;
+    const uint32_t first = src->row_runs_index[j + src_y];
+    const uint32_t last = src->row_runs_index[j + src_y + 1];
+    for (uint32_t k = first; k < last; k++) {
+      const Canvas::AlphaRun& run = src->row_runs[k];
+      const int start = std::max((int)run.start, src_x);
+      const int end = std::min((int)run.start + run.length, src_x + src_w);
+      if (start >= end) {
         continue;
       }
 
-      if (src_px.a == 0) {
-        continue;
+      RGBA *dst_px = &d[dst_x + start - src_x + (j + dst_y) * w];
+      const RGBA *src_px = &src->d[start + (j + src_y) * src->w];
+      if (run.opaque) {
+        memcpy(dst_px, src_px, (end - start) * sizeof(RGBA));
+      } else {
+        blend_row(dst_px, src_px, end - start);
       }
-
-      dst_px = RGBA{
-        (uint8_t)(((uint32_t)src_px.r * src_px.a + (uint32_t)dst_px.r * (255 - src_px.a)) >> 8),
-        (uint8_t)(((uint32_t)src_px.g * src_px.a + (uint32_t)dst_px.g * (255 - src_px.a)) >> 8),
-        (uint8_t)(((uint32_t)src_px.b * src_px.a + (uint32_t)dst_px.b * (255 - src_px.a)) >> 8),
-        std::max(src_px.a, dst_px.a)
-      };
     }
   }
 }
@@ -145,63 +341,141 @@ void Canvas::blit(Canvas *src, int dst_x, int dst_y) {
   blit(src, 0, 0, dst_x, dst_y, src->w, src->h);
 }
 
-RGBA Canvas::get_texel(Coordsf p, Coordsf sz) {
-  int sz_x = std::max(1, (int)(sz.x * w));
-  int sz_y = std::max(1, (int)(sz.y * h));
-
-  int x = (int)(std::clamp(p.x, 0.0f, 1.0f) * (float)(w - 1));
-  int y = (int)(std::clamp(p.y, 0.0f, 1.0f) * (float)(h - 1));
+RGBA Canvas::get_texel(Coordsf p, Coordsf sz) const {
+  return mipmap_level(sz)->get_texel(p);
+}
 
-  if (sz_x == 1 && sz_y == 1) {
-    return d[x + y * w];
+const Canvas *Canvas::mipmap_level(Coordsf sz) const {
+  // The footprint of a screen pixel in texels. The bigger axis wins, which
+  // might be a little blurry on floors seen at a steep angle, but that's where
+  // the fog kicks in anyway.
+  const int footprint = (int)std::max(sz.x * (float)w, sz.y * (float)h);
+  if (footprint < 2 || mipmaps.empty()) {
+    return this;
   }
 
-  // Try cache first.
-  auto& texel_pixel_cache = texel_cache[x + y * w];
-  uint32_t texel_sig = sz_x + (sz_y << 16);
-  auto texel_it = texel_pixel_cache.find(texel_sig);
-  if (texel_it != texel_pixel_cache.end()) {
-    return texel_it->second;
+  // Level N is 2^N times smaller, so it's just the index of the top bit.
+  const size_t level = 31 - __builtin_clz((unsigned int)footprint);
+  return &mipmaps[std::min(level, mipmaps.size()) - 1];
+}
+
+void Canvas::generate_mipmaps() {
+  mipmaps.clear();
+
+  const Canvas *src = this;
+  while (src->w > 1 || src->h > 1) {
+    // Note: odd sizes are rounded up and the last row/column is re-used.
+    Canvas level{(src->w + 1) / 2, (src->h + 1) / 2};
+
+    for (unsigned int j = 0; j < level.h; j++) {
+      for (unsigned int i = 0; i < level.w; i++) {
+        const unsigned int x0 = i * 2;
+        const unsigned int y0 = j * 2;
+        const unsigned int x1 = std::min(x0 + 1, src->w - 1);
+        const unsigned int y1 = std::min(y0 + 1, src->h - 1);
+        const RGBA px[4] = {
+          src->d[x0 + y0 * src->w], src->d[x1 + y0 * src->w],
+          src->d[x0 + y1 * src->w], src->d[x1 + y1 * src->w]
+        };
+
+        unsigned int count = 0;
+        unsigned int r = 0;
+        unsigned int g = 0;
+        unsigned int b = 0;
+
+        for (const RGBA& p : px) {
+          if (p.a != 255) continue;  // Same rule as in the old on-demand filter.
+          r += p.r;
+          g += p.g;
+          b += p.b;
+          count++;
+        }
+
+        if (count == 0) {
+          level.d[i + j * level.w] = RGBA{0, 0, 0, 0};
+          continue;
+        }
+
+        level.d[i + j * level.w] = RGBA{
+          (uint8_t)(r / count),
+          (uint8_t)(g / count),
+          (uint8_t)(b / count),
+          255
+        };
+      }
+    }
+
+    mipmaps.push_back(std::move(level));
+    src = &mipmaps.back();
   }
 
-  // The long way.
-  unsigned int count = 0;
-  unsigned int r = 0;
-  unsigned int g = 0;
-  unsigned int b = 0;
-  uint8_t a = 0;  // Use max of alpha instead of avg.
+  opaque = std::all_of(d.begin(), d.end(), [](const RGBA& p) {
+    return p.a == 255;
+  });
+
+  generate_blocked();
+  for (auto& level : mipmaps) {
+    level.generate_blocked();
+  }
 
-  for (unsigned int j = std::max(0, y - sz_y / 2);
-                    j <= (unsigned int)std::min((int)h - 1, y + sz_y / 2);
-                    j++) {
-    for (unsigned int i = std::max(0, x - sz_x / 2);
-                      i <= (unsigned int)std::min((int)w - 1, x + sz_x / 2);
-                      i++) {
-      const unsigned idx = i + j * w;
-      if (d[idx].a != 255) continue;
-      r += d[idx].r;
-      g += d[idx].g;
-      b += d[idx].b;
-      a = std::max(a, d[idx].a);
-      count++;
+  if (!opaque) {
+    generate_runs(true);
+    generate_runs(false);
+    for (auto& level : mipmaps) {
+      level.generate_runs(false);
     }
   }
+}
+
+void Canvas::generate_runs(bool rows) {
+  auto& runs = rows ? row_runs : column_runs;
+  auto& index = rows ? row_runs_index : column_runs_index;
+  const unsigned int lines = rows ? h : w;
+  const unsigned int length = rows ? w : h;
+  const unsigned int step = rows ? 1 : w;
+
+  runs.clear();
+  index.clear();
+
+  for (unsigned int j = 0; j < lines; j++) {
+    index.push_back((uint32_t)runs.size());
+
+    const RGBA *line = &d[rows ? j * w : j];
+    unsigned int i = 0;
+    while (i < length) {
+      const uint8_t a = line[i * step].a;
+      if (a == 0) {
+        i++;
+        continue;
+      }
 
-  if (count == 0 || a != 255) {
-    return RGBA{0, 0, 0, 0};
+      // Opaque and semi-transparent texels go into separate runs.
+      const unsigned int start = i;
+      while (i < length && line[i * step].a != 0 &&
+             (line[i * step].a == 255) == (a == 255)) {
+        i++;
+      }
+
+      runs.push_back(AlphaRun{
+          (uint16_t)start, (uint16_t)(i - start), a == 255});
+    }
   }
 
-  RGBA res{
-    (uint8_t)(r / count),
-    (uint8_t)(g / count),
-    (uint8_t)(b / count),
-    a
-  };
+  index.push_back((uint32_t)runs.size());
+}
 
-  // Fit into cache.
-  texel_pixel_cache[texel_sig] = res;
+void Canvas::generate_blocked() {
+  // The size is rounded up to whole blocks. The padding is never sampled.
+  const unsigned int blocks_w = (w + BLOCK_MASK) >> BLOCK_SHIFT;
+  const unsigned int blocks_h = (h + BLOCK_MASK) >> BLOCK_SHIFT;
+  blocked_stride = blocks_w << (2 * BLOCK_SHIFT);
+  blocked.assign(blocks_h * blocked_stride, RGBA{0, 0, 0, 0});
 
-  return res;
+  for (unsigned int j = 0; j < h; j++) {
+    for (unsigned int i = 0; i < w; i++) {
+      blocked[blocked_index(i, j)] = d[i + j * w];
+    }
+  }
 }
 
 bool ImageManager::load(const std::string& id,
@@ -211,25 +485,59 @@ bool ImageManager::load(const std::string& id,
     return false;
   }
 
-  images[id] = std::make_unique<Canvas>(s);
+  auto& image = images[handle(id)];
+  image = std::make_unique<Canvas>(s);
+  image->generate_mipmaps();
   SDL_FreeSurface(s);
   return true;
 }
 
 void ImageManager::add(const std::string& id, Canvas *c) {
-  assert(images.find(id) == images.end());
-  images[id].reset(c);
+  auto& image = images[handle(id)];
+  assert(image == nullptr);
+  c->generate_mipmaps();
+  image.reset(c);
+}
+
+texture_handle_t ImageManager::handle(const std::string& id) {
+  const auto iter = handles.find(id);
+  if (iter != handles.end()) {
+    return iter->second;
+  }
+
+  const texture_handle_t h = (texture_handle_t)images.size();
+  handles[id] = h;
+  images.emplace_back(nullptr);
+  ids.push_back(id);
+  return h;
 }
 
-Canvas* ImageManager::get(std::string id) {
-  if (images.find(id) == images.end()) {
+Canvas* ImageManager::get(const std::string& id) {
+  // Note: this is called from the render threads, so no operator[] here.
+  const auto iter = handles.find(id);
+  if (iter == handles.end()) {
     return nullptr;
   }
 
-  return images[id].get();
+  return images[iter->second].get();
 }
 
 
+void Render3D::set_resolution(int w, int h) {
+  assert(w <= WIDTH_3D && h <= HEIGHT_3D);
+  width = w;
+  height = h;
+  width_f = (float)w;
+  height_f = (float)h;
+  scale_3d = width_f / 10.0f;
+  offset_y = SCENE_3D_OFFSET_Y * h / HEIGHT_3D;
+  band_top = 0;
+  band_bottom = h - 1;
+
+  zbuffer.assign(w * h, DEPTH_STALE);
+  depth_epoch = 0;
+}
+
 Coords Render3D::point3D_to_2D(Coords3D p) {
   // This will behave weird with p.z == 0, but we don't really care.
   const float z = (p.z) * PERSPECTIVE_CORRECTION;
@@ -238,16 +546,16 @@ Coords Render3D::point3D_to_2D(Coords3D p) {
   const float flat_x = p.x / z;
   const float flat_y = (p.y - EYE_LEVEL) / z;
 
-  const float pixel_x = flat_x * SCALE_3D + (WIDTH_3DF / 2.0f);
-  const float pixel_y = flat_y * SCALE_3D + (WIDTH_3DF - HEIGHT_3DF) / 2.0f;
+  const float pixel_x = flat_x * scale_3d + (width_f / 2.0f);
+  const float pixel_y = flat_y * scale_3d + (width_f - height_f) / 2.0f;
 
   return Coords{(int)pixel_x, (int)pixel_y};
 }
 
 float Render3D::y_scanline_to_z(int y_scanline, float y) {
-  return ((y - EYE_LEVEL) * SCALE_3D) /
+  return ((y - EYE_LEVEL) * scale_3d) /
          (PERSPECTIVE_CORRECTION * (
-              (float)y_scanline - (WIDTH_3DF - HEIGHT_3DF) / 2.0f));
+              (float)y_scanline - (width_f - height_f) / 2.0f));
 }
 
 float Render3D::x_scanline_to_z(int x_scanline, Coords3D near, Coords3D far) {
@@ -258,11 +566,11 @@ float Render3D::x_scanline_to_z(int x_scanline, Coords3D near, Coords3D far) {
   const float Zd = far.z - near.z;
 
   const float K =
-      PERSPECTIVE_CORRECTION * ( (float)x_scanline - 0.5f * WIDTH_3DF );
+      PERSPECTIVE_CORRECTION * ( (float)x_scanline - 0.5f * width_f );
 
   const float Z =
-      ( SCALE_3D * ( -Zn * Xd + Xn * Zd ) ) /
-      ( K * Zd - Xd * SCALE_3D );
+      ( scale_3d * ( -Zn * Xd + Xn * Zd ) ) /
+      ( K * Zd - Xd * scale_3d );
 
   return Z;
 }
@@ -270,7 +578,7 @@ float Render3D::x_scanline_to_z(int x_scanline, Coords3D near, Coords3D far) {
 float Render3D::first_z_on_screen(float z, float y) {
 
   const float boundary_z = (y >= EYE_LEVEL) ?
-      y_scanline_to_z(HEIGHT_3D - 1, y) :  // Lower than eyesight.
+      y_scanline_to_z(height - 1, y) :  // Lower than eyesight.
       y_scanline_to_z(0, y);  // Higher than eyesight.
 
   // Nothing to do if z is already within the boundary.
@@ -313,7 +621,132 @@ void Render3D::line3D(Coords3D s, Coords3D e, RGBA color) {
   }
 }
 
-void Render3D::vquad(Coords3D s, Coords3D e, std::string texture_id) {
+void Render3D::vquad(
+    Coords3D s, Coords3D e, const std::string& texture_id) {
+  Canvas *texture = img->get(texture_id);
+  if (texture == nullptr) {
+    printf("error: missing texture '%s'\n", texture_id.c_str());
+    return;
+  }
+
+  vquad(s, e, texture);
+}
+
+void Render3D::vquad(Coords3D s, Coords3D e, const Canvas *texture) {
+  const QuadSpans *spans = quad_spans(s, e);
+  if (spans->columns.empty()) {
+    return;
+  }
+
+  for (const QuadColumn& col : spans->columns) {
+    int first_row = col.first_row;
+    int last_row = col.last_row;
+
+    if (coverage_enable) {
+      // Skip the column if it's fully covered, or trim it if it's covered
+      // from either end.
+      const CoverageSpan& cov = coverage[col.x];
+      if (first_row >= cov.top && last_row <= cov.bottom) {
+        continue;
+      }
+
+      if (first_row >= cov.top && first_row <= cov.bottom) {
+        first_row = cov.bottom + 1;
+      } else if (last_row >= cov.top && last_row <= cov.bottom) {
+        last_row = cov.top - 1;
+      }
+
+      if (texture->opaque) {
+        coverage_add(col.x, col.first_row, col.last_row);
+      }
+    }
+
+    const float texel_sz_vert = 1.0f / (float)(col.vert_diff);
+    const Canvas *mip = texture->mipmap_level(
+        Coordsf{spans->texel_sz_hor, texel_sz_vert});
+
+    // Texture column is fixed, the texture row is stepped in 16.16 fixed
+    // point. Since the span never leaves [top, bottom], the row never leaves
+    // [0, h - 1]. The texels are taken from the blocked copy, as it's much
+    // nicer to the cache when going down a column.
+    const int texel_x = (int)(col.u * (float)(mip->w - 1));
+    const RGBA *texels = mip->blocked.data();
+    const int64_t v_step = ((int64_t)(mip->h - 1) << 16) / col.vert_diff;
+
+    const float z = col.z;
+    const uint32_t depth = depth_key(z);
+    auto draw_rows = [&](int from, int to) {
+      size_t idx = col.x + from * width;
+      int64_t v = (int64_t)(from - col.top) * v_step;
+      for (int j = from; j <= to; j++, idx += width, v += v_step) {
+        // This might be a little out of place, but it gives a large FPS boost if checked early.
+        if (!zbuffer_ignore && depth >= zbuffer[idx]) {
+          continue;
+        }
+
+        pixel3D_unchecked(idx, j, z, depth,
+                          texels[mip->blocked_index(texel_x, v >> 16)]);
+      }
+    };
+
+    if (mip->column_runs_index.empty() || v_step == 0) {
+      draw_rows(first_row, last_row);
+      continue;
+    }
+
+    // Only draw the rows which land on the non-transparent runs of the
+    // texture column. Row j samples texel row ((j - top) * v_step) >> 16.
+    auto first_row_at = [&](int64_t texel_row) {
+      return col.top + (int)(((texel_row << 16) + v_step - 1) / v_step);
+    };
+
+    const uint32_t first = mip->column_runs_index[texel_x];
+    const uint32_t last = mip->column_runs_index[texel_x + 1];
+    for (uint32_t k = first; k < last; k++) {
+      const Canvas::AlphaRun& run = mip->column_runs[k];
+      const int from = std::max(first_row_at(run.start), first_row);
+      const int to = std::min(first_row_at(run.start + run.length) - 1,
+                              last_row);
+      if (from > last_row) {
+        break;
+      }
+
+      if (from <= to) {
+        draw_rows(from, to);
+      }
+    }
+  }
+}
+
+RGBA Render3D::vquad_texel(
+    Coords3D s, Coords3D e, const Canvas *texture, int x, int y) {
+  build_quad_spans(s, e, &quad_scratch);
+  const QuadSpans *spans = &quad_scratch;
+  for (const QuadColumn& col : spans->columns) {
+    if (col.x != x) {
+      continue;
+    }
+
+    if (y < col.first_row || y > col.last_row) {
+      break;
+    }
+
+    // Same sampling as in vquad().
+    const float texel_sz_vert = 1.0f / (float)(col.vert_diff);
+    const Canvas *mip = texture->mipmap_level(
+        Coordsf{spans->texel_sz_hor, texel_sz_vert});
+    const int texel_x = (int)(col.u * (float)(mip->w - 1));
+    const int64_t v_step = ((int64_t)(mip->h - 1) << 16) / col.vert_diff;
+    const int64_t v = (int64_t)(y - col.top) * v_step;
+    return mip->blocked[mip->blocked_index(texel_x, v >> 16)];
+  }
+
+  return RGBA{0, 0, 0, 0};
+}
+
+void Render3D::build_quad_spans(Coords3D s, Coords3D e, QuadSpans *out) {
+  out->columns.clear();
+
   // "n" is near, "f" is far
   const float Zn = s.z < e.z ? s.z : e.z;
   const float Zf = s.z < e.z ? e.z : s.z;
@@ -346,11 +779,11 @@ void Render3D::vquad(Coords3D s, Coords3D e, std::string texture_id) {
     if (Xd != 0.0f) {
       Zcandidate = (Xd < 0.0f) ?
         x_scanline_to_z(0.0f, near, far) :
-        x_scanline_to_z(WIDTH_3DF - 1.0f, near, far);
+        x_scanline_to_z(width_f - 1.0f, near, far);
     } else {
       Zcandidate = (Xn < 0.0f) ?
         x_scanline_to_z(0.0f, near, far) :
-        x_scanline_to_z(WIDTH_3DF - 1.0f, near, far);
+        x_scanline_to_z(width_f - 1.0f, near, far);
     }
 
     if (Zcandidate >= Zn && Zcandidate <= Zf) {
@@ -373,61 +806,114 @@ void Render3D::vquad(Coords3D s, Coords3D e, std::string texture_id) {
 
   //printf("edges: %i <--> %i\n", edge_left_2D, edge_right_2D);
 
-  if (edge_right_2D < 0 || edge_left_2D >= WIDTH_3D) {
+  if (edge_right_2D < 0 || edge_left_2D >= width) {
     return;
   }
 
-  const int clamped_edge_left_2D = std::clamp(edge_left_2D, 0, WIDTH_3D - 1);
-  const int clamped_edge_right_2D = std::clamp(edge_right_2D, 0, WIDTH_3D - 1);
+  const int clamped_edge_left_2D = std::clamp(edge_left_2D, 0, width - 1);
+  const int clamped_edge_right_2D = std::clamp(edge_right_2D, 0, width - 1);
 
-  Canvas *texture = img->get(texture_id);
-  if (texture == nullptr) {
-    printf("error: missing texture '%s'\n", texture_id.c_str());
-    return;
+  // Everything from here is set up once per quad. Since the quad is planar,
+  // 1/z changes linearly with the screen column:
+  //   1/z(i) = inv_z_start + inv_z_step * i
+  // (see x_scanline_to_z for the derivation of z), and both the top and bottom
+  // edges of the quad are linear functions of 1/z.
+  const float D = scale_3d * (Xn * Zd - Zn * Xd);
+  if (D == 0.0f) {
+    return;  // The quad is seen exactly edge-on.
   }
 
-  // For each vertical scanline (scancolumn?).
+  const float inv_z_step = PERSPECTIVE_CORRECTION * Zd / D;
+  const float inv_z_start =
+      (-PERSPECTIVE_CORRECTION * Zd * 0.5f * width_f - Xd * scale_3d) / D;
+
+  const float center_y = (width_f - height_f) / 2.0f;
+  const float top_k = (Yt - EYE_LEVEL) * scale_3d / PERSPECTIVE_CORRECTION;
+  const float bottom_k = (Yb - EYE_LEVEL) * scale_3d / PERSPECTIVE_CORRECTION;
 
-  const float texel_sz_hor = 1.0f / (float)(edge_hor_diff);
+  out->texel_sz_hor = 1.0f / (float)(edge_hor_diff);
+  const float p_step = edge_hor_diff == 0 ? 0.0f : out->texel_sz_hor;
+
+  // Rows above offset_y are never shown (see pixel3D), so there is
+  // no point in going there. Nor outside of the band.
+  const int visible_top = std::max(offset_y, band_top);
+  const int visible_bottom = std::min(height - 1, band_bottom);
+
+  // For each vertical scanline (scancolumn?).
   for (int i = clamped_edge_left_2D; i <= clamped_edge_right_2D; i++) {
-    const float z = x_scanline_to_z(i, near, far);
-    const float p = edge_hor_diff == 0 ?
-        0.0f : (float)(i - edge_left_2D) / (float)(edge_hor_diff);
-    const float x = p * Xd + Xn;
+    const float inv_z = inv_z_start + inv_z_step * (float)i;
+    if (inv_z <= 0.0f) {
+      continue;  // Rounding at the near plane.
+    }
 
-    int edge_top_2D = point3D_to_2D(Coords3D{x, Yt, z}).y;
-    int edge_bottom_2D = point3D_to_2D(Coords3D{x, Yb, z}).y;
+    const int edge_top_2D = (int)(top_k * inv_z + center_y);
+    const int edge_bottom_2D = (int)(bottom_k * inv_z + center_y);
 
-    if (edge_bottom_2D < 0 || edge_top_2D >= HEIGHT_3D) {
+    if (edge_bottom_2D < visible_top || edge_top_2D > visible_bottom) {
       continue;
     }
 
-    int clamped_edge_top_2D = std::clamp(edge_top_2D, 0, HEIGHT_3D - 1);
-    int clamped_edge_bottom_2D = std::clamp(edge_bottom_2D, 0, HEIGHT_3D - 1);
-
     int edge_vert_diff = edge_bottom_2D - edge_top_2D;
     if (edge_vert_diff == 0) {
       edge_vert_diff = 1;
     }
 
-    const float texel_sz_vert = 1.0f / (float)(edge_vert_diff);
-    for (int j = clamped_edge_top_2D; j <= clamped_edge_bottom_2D; j++) {
-      // This might be a little out of place, but it gives a large FPS boost if checked early.
-      if (!zbuffer_ignore && z >= zbuffer[i + j * WIDTH_3D]) {
-        continue;
-      }
+    const float p = (float)(i - edge_left_2D) * p_step;
+
+    out->columns.push_back(QuadColumn{
+        i,
+        edge_top_2D,
+        std::max(edge_top_2D, visible_top),
+        std::min(edge_bottom_2D, visible_bottom),
+        edge_vert_diff,
+        1.0f / inv_z,  // The only division per column.
+        std::clamp(p, 0.0f, 1.0f)
+    });
+  }
+}
+
+void Render3D::tile(
+    Coords3D m, Coords3D sz, const std::string& texture_id) {
+  Canvas *texture = img->get(texture_id);
+  if (texture == nullptr) {
+    printf("error: missing texture %s\n", texture_id.c_str());
+    return;
+  }
 
-      const float r = (float)(j - edge_top_2D) / (float)(edge_vert_diff);
+  tile(m, sz, texture);
+}
 
-      const Coordsf texel_pos = Coordsf{p, r};
-      const Coordsf texel_sz = Coordsf{texel_sz_hor, texel_sz_vert};
+void Render3D::tile(Coords3D m, Coords3D sz, const Canvas *texture) {
+  const TileSpans *spans = tile_spans(m, sz);
+  if (spans->rows.empty()) {
+    return;
+  }
 
-      pixel3D(Coords{i, j}, z, texture->get_texel(texel_pos, texel_sz));
+  for (const TileRow& row : spans->rows) {
+    const float texel_size_x = 1.0f / (float)row.span_w;
+    const Canvas *mip = texture->mipmap_level(
+        Coordsf{texel_size_x, row.texel_sz_z});
+
+    // The texture row is fixed, the texture column is stepped in 16.16 fixed
+    // point across the (clipped) span.
+    const RGBA *texel_row =
+        mip->d.data() + (int)(row.v * (float)(mip->h - 1)) * mip->w;
+    const int64_t u_step = ((int64_t)(mip->w - 1) << 16) / row.span_w;
+    int64_t u = (int64_t)(row.first_i - row.start_x) * u_step;
+
+    const float z = row.z;
+    const uint32_t depth = depth_key(z);
+    const int j = row.y;
+    size_t idx = row.first_i + j * width;
+    for (int i = row.first_i; i <= row.last_i; i++, idx++, u += u_step) {
+      pixel3D_unchecked(idx, j, z, depth, texel_row[u >> 16]);
     }
   }
 }
 
-void Render3D::tile(Coords3D m, Coords3D sz, std::string texture_id) {
+void Render3D::build_tile_spans(Coords3D m, Coords3D sz, TileSpans *out) {
+  out->rows.clear();
+
   // Typical use case:
   //
   //               near_z
@@ -462,7 +948,7 @@ void Render3D::tile(Coords3D m, Coords3D sz, std::string texture_id) {
   // If 2D(far_z) is below or above the canvas edge, there is nothing to do
   // either.
   Coords far_edge_2D = point3D_to_2D(Coords3D{m.x, m.y, far_z});
-  if (far_edge_2D.y >= HEIGHT_3D || far_edge_2D.y < 0) {
+  if (far_edge_2D.y >= height || far_edge_2D.y < 0) {
     return;
   }
 
@@ -477,52 +963,200 @@ void Render3D::tile(Coords3D m, Coords3D sz, std::string texture_id) {
   const float left_edge_3D = m.x - sz.x * 0.5f;
   const float right_edge_3D = m.x + sz.x * 0.5f;
 
-  Canvas *texture = img->get(texture_id);
-  if (texture == nullptr) {
-    printf("error: missing texture %s\n", texture_id.c_str());
-    return;
+  // Per-scanline values depend only on the height of the tile (the camera
+  // never changes its height), so they come from a precomputed table.
+  const ScanlineTable *table = scanline_table(m.y);
+  const float inv_depth = 1.0f / (far_z - near_z);
+  const float inv_sz_z = 1.0f / sz.z;
+
+  // Rows above offset_y are never shown (see pixel3D). Nor outside
+  // of the band.
+  const int first_row =
+      std::max({top_edge_2D, offset_y, band_top});
+  const int last_row = std::min({bottom_edge_2D, height - 1, band_bottom});
+
+  for (int j = first_row; j <= last_row; j++) {
+    const Scanline& line = table->lines[j];
+    const float z = line.z;
+    const int start_x_2D = (int)(left_edge_3D * line.x_scale + width_f / 2.0f);
+    const int end_x_2D = (int)(right_edge_3D * line.x_scale + width_f / 2.0f);
+
+    if (end_x_2D < 0 || start_x_2D >= width) {
+      continue;
+    }
+
+    out->rows.push_back(TileRow{
+        j,
+        start_x_2D,
+        end_x_2D - start_x_2D + 1,
+        std::max(start_x_2D, 0),
+        std::min(end_x_2D, width - 1),
+        z,
+        std::clamp((z - near_z) * inv_depth, 0.0f, 1.0f),
+        line.z_delta * inv_sz_z
+    });
+  }
+}
+
+const Render3D::ScanlineTable *Render3D::scanline_table(float y) {
+  // There are only a couple of different floor/ceiling heights in the game,
+  // so a linear search is good enough.
+  for (const auto& table : scanline_tables) {
+    if (table->y == y) {
+      return table.get();
+    }
+  }
+
+  auto table = std::make_unique<ScanlineTable>();
+  table->y = y;
+  table->lines.resize(height);
+
+  float last_z = y_scanline_to_z(-1, y);
+  for (int j = 0; j < height; j++) {
+    const float z = y_scanline_to_z(j, y);
+    table->lines[j] = Scanline{
+        z,
+        std::abs(z - last_z),
+        scale_3d / (z * PERSPECTIVE_CORRECTION)
+    };
+    last_z = z;
   }
 
-  float last_z = y_scanline_to_z(top_edge_2D - 1, m.y);
+  scanline_tables.push_back(std::move(table));
+  return scanline_tables.back().get();
+}
 
-  for (int j = top_edge_2D; j <= bottom_edge_2D; j++) {
-    const float z = y_scanline_to_z(j, m.y);
-    const int start_x_2D = point3D_to_2D(Coords3D{left_edge_3D, m.y, z}).x;
-    const int end_x_2D = point3D_to_2D(Coords3D{right_edge_3D, m.y, z}).x;
+size_t Render3D::ProjectionKeyHash::operator()(
+    const ProjectionKey& key) const {
+  // FNV-1a over the raw bytes of the coordinates. They are always computed
+  // the same way, so bit-exact comparison is fine.
+  const uint8_t *data = (const uint8_t*)key.v;
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < sizeof(key.v); i++) {
+    hash = (hash ^ data[i]) * 1099511628211ULL;
+  }
+  return (size_t)hash;
+}
 
+template<typename T>
+const T *Render3D::projection_cache_get(
+    std::unordered_map<ProjectionKey, std::unique_ptr<T>,
+                       ProjectionKeyHash> *cache,
+    const ProjectionKey& key, T *scratch,
+    void (Render3D::*build)(Coords3D, Coords3D, T*)) {
+  const Coords3D a{key.v[0], key.v[1], key.v[2]};
+  const Coords3D b{key.v[3], key.v[4], key.v[5]};
 
-    const float progress_z = (z - near_z) / (far_z - near_z);
+  if (!projection_cache_enable) {
+    (this->*build)(a, b, scratch);
+    return scratch;
+  }
 
-    const float texel_size_z = fabs((z - last_z) / sz.z);
+  // Same two-generation scheme as in TextRenderer: anything that was not used
+  // in the last frame is dropped on the frame change.
+  auto& current = cache[projection_cache_current];
+  auto& next = cache[projection_cache_current ^ 1];
 
-    float last_x = left_edge_3D;
-    for (int i = start_x_2D; i <= end_x_2D; i++) {
-      const float progress_x =
-          (float)(i - start_x_2D) / (float)(end_x_2D - start_x_2D + 1);
+  auto iter = next.find(key);
+  if (iter != next.end()) {
+    return iter->second.get();
+  }
 
-      const float x = left_edge_3D + progress_x * sz.x;
-      const float texel_size_x = fabs((x - last_x) / sz.x);
-      last_x = x;
+  auto node = current.extract(key);
+  if (!node.empty()) {
+    return next.insert(std::move(node)).position->second.get();
+  }
 
-      if (i < 0 || i >= WIDTH_3D) {  // Don't bother for stuff off screen.
-        continue;
-      }
+  auto spans = std::make_unique<T>();
+  (this->*build)(a, b, spans.get());
+  return next.emplace(key, std::move(spans)).first->second.get();
+}
 
-      const Coordsf texel_sz{texel_size_x, texel_size_z};
-      const Coordsf texel_pos{progress_x, progress_z};
-      pixel3D(Coords{i, j}, z, texture->get_texel(texel_pos, texel_sz));
+const Render3D::QuadSpans *Render3D::quad_spans(Coords3D s, Coords3D e) {
+  return projection_cache_get(
+      quad_cache, ProjectionKey{{s.x, s.y, s.z, e.x, e.y, e.z}},
+      &quad_scratch, &Render3D::build_quad_spans);
+}
 
-    }
+const Render3D::TileSpans *Render3D::tile_spans(Coords3D m, Coords3D sz) {
+  return projection_cache_get(
+      tile_cache, ProjectionKey{{m.x, m.y, m.z, sz.x, sz.y, sz.z}},
+      &tile_scratch, &Render3D::build_tile_spans);
+}
 
-    last_z = z;
+void Render3D::projection_cache_hint_frame_change() {
+  quad_cache[projection_cache_current].clear();
+  tile_cache[projection_cache_current].clear();
+  projection_cache_current ^= 1;
+}
+
+void Render3D::coverage_reset() {
+  for (int i = 0; i < width; i++) {
+    coverage[i] = coverage_pending[i] = CoverageSpan{1, 0};
+  }
+  coverage_full_columns = 0;
+}
+
+void Render3D::coverage_add(int x, int top, int bottom) {
+  // Only a single range per column is kept. Ranges that touch are merged,
+  // otherwise the larger one wins (this is just an optimization after all).
+  CoverageSpan& cov = coverage_pending[x];
+  if (cov.top > cov.bottom) {
+    cov = CoverageSpan{top, bottom};
+  } else if (bottom >= cov.top - 1 && top <= cov.bottom + 1) {
+    cov.top = std::min(cov.top, top);
+    cov.bottom = std::max(cov.bottom, bottom);
+  } else if (bottom - top > cov.bottom - cov.top) {
+    cov = CoverageSpan{top, bottom};
+  }
+}
+
+void Render3D::coverage_commit() {
+  const int visible_top = std::max(offset_y, band_top);
+  const int visible_bottom = std::min(height - 1, band_bottom);
+
+  coverage_full_columns = 0;
+  for (int i = 0; i < width; i++) {
+    coverage[i] = coverage_pending[i];
+    if (coverage[i].top <= visible_top &&
+        coverage[i].bottom >= visible_bottom) {
+      coverage_full_columns++;
+    }
   }
 }
 
 void Render3D::fog_setup(bool enable, RGBA color, float intensity) {
   this->fog_enable = enable;
-  if (enable) {
-    this->fog_color = color;
-    this->fog_intensity = intensity;
+  if (!enable) {
+    return;
+  }
+
+  if (!fog_table.empty() &&
+      memcmp(&fog_color, &color, sizeof(RGBA)) == 0 &&
+      fog_intensity == intensity) {
+    return;  // Nothing changed.
+  }
+
+  this->fog_color = color;
+  this->fog_intensity = intensity;
+
+  // The table spans the range where the fog actually changes. Anything
+  // closer has no fog, anything further is fully fogged.
+  const float none_distance = FOG_NONE_DISTANCE / this->fog_intensity;
+  const float max_distance = FOG_MAX_DISTANCE / this->fog_intensity;
+  fog_table_start = none_distance;
+  fog_table_scale =
+      (float)(FOG_TABLE_SIZE - 1) / (max_distance - none_distance);
+
+  fog_table.resize(FOG_TABLE_SIZE);
+  for (int i = 0; i < FOG_TABLE_SIZE; i++) {
+    const RGBA fog = fog_get_color(none_distance + (float)i / fog_table_scale);
+    fog_table[i] = FogEntry{
+        (uint16_t)(fog.r * fog.a),
+        (uint16_t)(fog.g * fog.a),
+        (uint16_t)(fog.b * fog.a),
+        (uint16_t)(255 - fog.a)
+    };
   }
 }
 
@@ -610,89 +1244,445 @@ void Render3D::helper_3D_floor(float x, float z) {
   */
 }
 
-void TextRenderer::hint_frame_change() {
-  std::unordered_map<std::string, CachedText*>& deprecated = cache[cache_current];
-
-  for (auto i : deprecated) {
-    delete i.second->text;
-    delete i.second;
+void DisplayList::clear() {
+  for (auto& stage : stages) {
+    stage.clear();
   }
+  rows.clear();
+  pickable = false;
+  itemid = ITEM_NON_EXISTING_ID;
+}
 
-  deprecated.clear();
-
-  cache_current ^= 1;
+void DisplayList::next_row() {
+  rows.push_back(stages[STAGES - 1].size());
 }
 
-int TextRenderer::printf(
-    Canvas *dst, int x, int y, int w, int h, const char *fmt, ...) {
+void DisplayList::vquad(
+    int stage, Coords3D s, Coords3D e, texture_handle_t texture) {
+  add(&stages[stage], Primitive::QUAD, s, e, texture);
+}
 
-  std::string formatted_text = "\0";
+void DisplayList::tile(
+    int stage, Coords3D m, Coords3D sz, texture_handle_t texture) {
+  add(&stages[stage], Primitive::TILE, m, sz, texture);
+}
 
-  va_list args;
+void DisplayList::sprite(Coords3D s, Coords3D e, texture_handle_t texture) {
+  add(&stages[STAGES - 1], Primitive::QUAD, s, e, texture);
+}
 
-  va_start(args, fmt);
-  int required_size = vsnprintf(
-      formatted_text.data(), formatted_text.size(), fmt, args);
-  va_end(args);
+void DisplayList::pickable_list(std::vector<const Primitive*> *out) const {
+  out->clear();
 
-  formatted_text.resize(required_size + 1);  // +1 for \0 (vsnprintf needs it).
+  // Same order as in replay().
+  const auto& last = stages[STAGES - 1];
+  size_t row_end = last.size();
+  for (size_t i = rows.size(); i-- > 0; ) {
+    for (size_t j = rows[i]; j < row_end; j++) {
+      if (last[j].pickable) {
+        out->push_back(&last[j]);
+      }
+    }
+    row_end = rows[i];
+  }
+}
 
-  va_start(args, fmt);
-  vsnprintf(
-      formatted_text.data(), formatted_text.size(), fmt, args);
-  va_end(args);
+void DisplayList::add(std::vector<Primitive> *dst,
+                      Primitive::primitive_type_t type,
+                      Coords3D a, Coords3D b, texture_handle_t texture) {
+  const Canvas *c = img->get(texture);
+  if (c == nullptr) {
+    printf("error: missing texture '%s'\n",
+           texture == TEXTURE_NO_HANDLE ? "" : img->id(texture).c_str());
+    return;
+  }
 
-  formatted_text.pop_back();  // Remove the \0, std::string doesn't need it.
-  return render(dst, x, y, w, h, formatted_text);
+  dst->push_back(Primitive{type, pickable, itemid, a, b, c});
 }
 
-int TextRenderer::render(
-    Canvas *dst, int x, int y, int w, int h, const std::string& text) {
-  int lines_rendered;
-
+void DisplayList::replay(Render3D *r) const {
+  auto draw = [r](const Primitive& p) {
+    if (p.type == Primitive::QUAD) {
+      r->vquad(p.a, p.b, p.texture);
+    } else {
+      r->tile(p.a, p.b, p.texture);
+    }
+  };
+
+  r->zbuffer_ignore = true;
+  for (int stage = 0; stage < STAGES - 1; stage++) {
+    for (const auto& p : stages[stage]) {
+      draw(p);
+    }
+  }
+
+  // The last stage goes front to back to use the Z-buffer in the fullest.
+  // Everything in a given row of the view cone is closer than anything in
+  // the next row, so once a row is done whatever it covered can be skipped.
+  r->zbuffer_ignore = false;
+  r->coverage_reset();
+  r->coverage_enable = true;
+
+  const auto& last = stages[STAGES - 1];
+  size_t row_end = last.size();
+  for (size_t i = rows.size(); i-- > 0; ) {
+    if (r->coverage_full()) {
+      break;
+    }
+
+    for (size_t j = rows[i]; j < row_end; j++) {
+      draw(last[j]);
+    }
+    row_end = rows[i];
+
+    r->coverage_commit();
+  }
+
+  r->coverage_enable = false;
+}
+
+void UILayer::begin() {
+  std::swap(widgets, previous);
+  widgets.clear();
+}
+
+void UILayer::blit(const Canvas *src,
+                   int src_x, int src_y,
+                   int dst_x, int dst_y,
+                   int src_w, int src_h,
+                   uint64_t revision) {
+  assert(dst_x >= 0 && dst_y >= 0);  // Same as in Canvas::blit.
+  assert(src_x >= 0 && src_y >= 0);
+  src_w = std::min(src_w, (int)w - dst_x);
+  src_h = std::min(src_h, (int)h - dst_y);
+  if (src == nullptr || src_w <= 0 || src_h <= 0) {
+    return;
+  }
+
+  widgets.push_back(Widget{
+      src, src_x, src_y, dst_x, dst_y, src_w, src_h, revision});
+}
+
+void UILayer::blit(const Canvas *src, int dst_x, int dst_y,
+                   uint64_t revision) {
+  if (src == nullptr) {
+    return;
+  }
+
+  blit(src, 0, 0, dst_x, dst_y, src->w, src->h, revision);
+}
+
+void UILayer::end() {
+  // Whatever changed has to be redrawn both where it was and where it is.
+  const size_t count = std::max(widgets.size(), previous.size());
+  for (size_t i = 0; i < count; i++) {
+    const bool in_old = i < previous.size();
+    const bool in_new = i < widgets.size();
+    if (in_old && in_new && widgets[i] == previous[i]) {
+      continue;
+    }
+
+    if (in_old) {
+      add_dirty(previous[i]);
+    }
+
+    if (in_new) {
+      add_dirty(widgets[i]);
+    }
+  }
+
+  if (dirty.empty() && !runs_index.empty()) {
+    return;
+  }
+
+  for (const auto& rect : dirty) {
+    redraw(rect);
+  }
+  dirty.clear();
+
+  generate_runs();
+}
+
+void UILayer::generate_runs() {
+  runs.clear();
+  runs_index.clear();
+  opaque_colors.resize(d.size());
+
+  for (unsigned int j = 0; j < h; j++) {
+    runs_index.push_back((uint32_t)runs.size());
+
+    const Pixel *line = &d[j * w];
+    unsigned int i = 0;
+    while (i < w) {
+      const uint16_t k = line[i].k;
+      if (k == 256) {
+        i++;
+        continue;
+      }
+
+      const unsigned int start = i;
+      while (i < w && line[i].k != 256 && (line[i].k == 0) == (k == 0)) {
+        if (k == 0) {
+          opaque_colors[i + j * w] = RGBA{
+              (uint8_t)(line[i].r >> 8), (uint8_t)(line[i].g >> 8),
+              (uint8_t)(line[i].b >> 8), line[i].a};
+        }
+        i++;
+      }
+
+      runs.push_back(Canvas::AlphaRun{
+          (uint16_t)start, (uint16_t)(i - start), k == 0});
+    }
+  }
+
+  runs_index.push_back((uint32_t)runs.size());
+}
+
+void UILayer::add_dirty(const Widget& widget) {
+  Rect rect{widget.dst_x, widget.dst_y,
+            widget.dst_x + widget.w, widget.dst_y + widget.h};
+
+  // Overlapping rects are merged, so that nothing is redrawn twice. This
+  // might grow an existing rect into another one, hence the restart.
+  for (size_t i = 0; i < dirty.size(); ) {
+    const Rect& o = dirty[i];
+    if (rect.x0 >= o.x1 || o.x0 >= rect.x1 ||
+        rect.y0 >= o.y1 || o.y0 >= rect.y1) {
+      i++;
+      continue;
+    }
+
+    rect = Rect{std::min(rect.x0, o.x0), std::min(rect.y0, o.y0),
+                std::max(rect.x1, o.x1), std::max(rect.y1, o.y1)};
+    dirty.erase(dirty.begin() + i);
+    i = 0;
+  }
+
+  dirty.push_back(rect);
+}
+
+void UILayer::redraw(const Rect& rect) {
+  for (int j = rect.y0; j < rect.y1; j++) {
+    std::fill(d.begin() + rect.x0 + j * w, d.begin() + rect.x1 + j * w,
+              Pixel{0, 0, 0, 256, 0});
+  }
+
+  auto fold = [](Pixel *px, const RGBA *src_px, int n) {
+    for (int i = 0; i < n; i++, src_px++, px++) {
+      const uint32_t a = src_px->a;
+      if (a == 0) {
+        continue;
+      }
+
+      if (a == 255) {
+        *px = Pixel{(uint16_t)(src_px->r << 8), (uint16_t)(src_px->g << 8),
+                    (uint16_t)(src_px->b << 8), 0, 255};
+        continue;
+      }
+
+      // Fold (s * a + under * (255 - a)) >> 8 into the pixel.
+      px->r = (uint16_t)((((src_px->r * a) << 8) + px->r * (255 - a)) >> 8);
+      px->g = (uint16_t)((((src_px->g * a) << 8) + px->g * (255 - a)) >> 8);
+      px->b = (uint16_t)((((src_px->b * a) << 8) + px->b * (255 - a)) >> 8);
+      px->k = (uint16_t)((px->k * (255 - a)) >> 8);
+      px->a = std::max(px->a, (uint8_t)a);
+    }
+  };
+
+  for (const auto& widget : widgets) {
+    const int x0 = std::max(rect.x0, widget.dst_x);
+    const int y0 = std::max(rect.y0, widget.dst_y);
+    const int x1 = std::min(rect.x1, widget.dst_x + widget.w);
+    const int y1 = std::min(rect.y1, widget.dst_y + widget.h);
+    const Canvas *src = widget.src;
+
+    for (int j = y0; j < y1; j++) {
+      // In source coordinates.
+      const int src_y = widget.src_y + j - widget.dst_y;
+      const int src_x0 = widget.src_x + x0 - widget.dst_x;
+      const int src_x1 = widget.src_x + x1 - widget.dst_x;
+      Pixel *line = &d[j * w] + widget.dst_x - widget.src_x;
+
+      if (src->row_runs_index.empty()) {
+        fold(line + src_x0, &src->d[src_x0 + src_y * src->w], src_x1 - src_x0);
+        continue;
+      }
+
+      // Only the non-transparent runs of images.
+      const uint32_t first = src->row_runs_index[src_y];
+      const uint32_t last = src->row_runs_index[src_y + 1];
+      for (uint32_t k = first; k < last; k++) {
+        const Canvas::AlphaRun& run = src->row_runs[k];
+        const int start = std::max((int)run.start, src_x0);
+        const int end = std::min((int)run.start + run.length, src_x1);
+        if (start < end) {
+          fold(line + start, &src->d[start + src_y * src->w], end - start);
+        }
+      }
+    }
+  }
+}
+
+void UILayer::composite(const Canvas *under, Canvas *dst) const {
+  assert(under->w == w && under->h == h);
+  assert(dst->w == w && dst->h == h);
+
+  if (under != dst) {
+    memcpy(dst->d.data(), under->d.data(), d.size() * sizeof(RGBA));
+  }
+
+  if (runs_index.empty()) {
+    return;  // Nothing was drawn yet.
+  }
+
+  for (unsigned int j = 0; j < h; j++) {
+    for (uint32_t r = runs_index[j]; r < runs_index[j + 1]; r++) {
+      const Canvas::AlphaRun& run = runs[r];
+      const size_t idx = run.start + j * w;
+      if (run.opaque) {
+        memcpy(&dst->d[idx], &opaque_colors[idx], run.length * sizeof(RGBA));
+        continue;
+      }
+
+      const Pixel *px = &d[idx];
+      RGBA *dst_px = &dst->d[idx];
+      for (int i = 0; i < run.length; i++, px++, dst_px++) {
+        const RGBA u = *dst_px;
+        *dst_px = RGBA{
+          (uint8_t)((px->r + u.r * px->k) >> 8),
+          (uint8_t)((px->g + u.g * px->k) >> 8),
+          (uint8_t)((px->b + u.b * px->k) >> 8),
+          std::max(px->a, u.a)
+        };
+      }
+    }
+  }
+}
+
+std::unique_ptr<Canvas> CanvasPool::get(unsigned int w, unsigned int h) {
+  const size_t pixels = (size_t)w * h;
+  auto& free_list = free_canvases[size_class(pixels)];
+
+  std::unique_ptr<Canvas> c;
+  if (free_list.empty()) {
+    c = std::make_unique<Canvas>(0, 0);
+    c->d.reserve(size_t(1) << size_class(pixels));
+  } else {
+    c = std::move(free_list.back());
+    free_list.pop_back();
+  }
+
+  // Never reallocates, as the capacity is the size of the class.
+  c->w = w;
+  c->h = h;
+  c->d.assign(pixels, RGBA{0, 0, 0, 0});
+  return c;
+}
+
+void CanvasPool::put(std::unique_ptr<Canvas> c) {
+  auto& free_list = free_canvases[size_class(c->d.capacity())];
+  if (free_list.size() < MAX_FREE_PER_CLASS) {
+    free_list.push_back(std::move(c));
+  }
+}
+
+void TextRenderer::hint_frame_change() {
+  frame++;
+  cache_trim();
+}
+
+int TextRenderer::printf(
+    Canvas *dst, int x, int y, int w, int h, const char *fmt, ...) {
+
+  std::string formatted_text = "\0";
+
+  va_list args;
+
+  va_start(args, fmt);
+  int required_size = vsnprintf(
+      formatted_text.data(), formatted_text.size(), fmt, args);
+  va_end(args);
+
+  formatted_text.resize(required_size + 1);  // +1 for \0 (vsnprintf needs it).
+
+  va_start(args, fmt);
+  vsnprintf(
+      formatted_text.data(), formatted_text.size(), fmt, args);
+  va_end(args);
+
+  formatted_text.pop_back();  // Remove the \0, std::string doesn't need it.
+  return render(dst, x, y, w, h, formatted_text);
+}
+
+int TextRenderer::render(
+    Canvas *dst, int x, int y, int w, int h, const std::string& text) {
+  int lines_rendered;
+
   // The returned canvas is owned by the caching part of TextRenderer.
-  Canvas *rendered_text = render_worker(text, w, h, &lines_rendered);
+  Canvas *rendered_text = render_worker(
+      text, w, h, cache_key(text, w, h), &lines_rendered);
   dst->blit(rendered_text, 0, 0, x, y, w, h);
 
   return lines_rendered;
 }
 
-Canvas *TextRenderer::render_worker(
-    const std::string& text, int w, int h, int *lines_rendered) {
-  std::string key = cache_key(text, w, h);
+int TextRenderer::render(
+    UILayer *dst, int x, int y, int w, int h, const std::string& text) {
+  int lines_rendered;
 
+  // The cached canvases come and go, so the text itself is the revision.
+  const uint64_t key = cache_key(text, w, h);
+  Canvas *rendered_text = render_worker(text, w, h, key, &lines_rendered);
+  dst->blit(rendered_text, 0, 0, x, y, w, h, key);
+
+  return lines_rendered;
+}
+
+Canvas *TextRenderer::render_worker(
+    const std::string& text, int w, int h, uint64_t key,
+    int *lines_rendered) {
   // Attempt to get the text from cache.
-  CachedText *cached_text = cache_get(key);
-  if (cached_text != nullptr) {
-    *lines_rendered = cached_text->lines_rendered;
-    return cached_text->text;
+  auto iter = cache.find(key);
+  if (iter != cache.end()) {
+    auto entry = iter->second;
+    if (entry->w == w && entry->h == h && entry->text == text) {
+      stats.hits++;
+      entry->frame = frame;
+      lru.splice(lru.begin(), lru, entry);
+      *lines_rendered = entry->lines_rendered;
+      return entry->canvas.get();
+    }
+
+    cache_remove(entry);  // Collision, the new text takes its place.
   }
 
+  stats.misses++;
+
   // Actually render the text.
-  Canvas *rendered_text = new Canvas{(unsigned int)w, (unsigned int)h};
+  std::unique_ptr<Canvas> canvas = pool.get(w, h);
+  Canvas *rendered_text = canvas.get();
+  const int lines_rendered_counter = rasterize(rendered_text, w, h, text);
 
-  // Ubuntu color scheme.
-  // https://en.wikipedia.org/wiki/ANSI_escape_code#3/4_bit
-  const RGBA color_scheme[] {
-    { 1,1,1,255 },
-    { 222,56,43,255 },
-    { 57,181,74,255 },
-    { 255,199,6,255 },
-    { 0,111,184,255 },
-    { 118,38,113,255 },
-    { 44,181,233,255 },
-    { 204,204,204,255 },
-    { 128,128,128,255 },
-    { 255,0,0,255 },
-    { 0,255,0,255 },
-    { 255,255,0,255 },
-    { 0,0,255,255 },
-    { 255,0,255,255 },
-    { 0,255,255,255 },
-    { 255,255,255,255 }
-  };
+  // Add it to the cache.
+  lru.push_front(CachedText{
+      key, text, w, h, lines_rendered_counter, std::move(canvas), frame});
+  cache[key] = lru.begin();
+  stats.entries++;
+  stats.bytes += rendered_text->d.capacity() * sizeof(RGBA);
+  cache_trim();
+
+  *lines_rendered = lines_rendered_counter;
+  return rendered_text;
+}
 
-  RGBA current_color = color_scheme[DEFAULT_TEXT_COLOR];
+int TextRenderer::render_uncached(
+    Canvas *dst, int w, int h, const std::string& text) {
+  return rasterize(dst, w, h, text);
+}
+
+int TextRenderer::rasterize(
+    Canvas *rendered_text, int w, int h, const std::string& text) {
+  int current_color = DEFAULT_TEXT_COLOR;
 
   // Rendering is done on a word-by-word basis.
   int x = 1;
@@ -793,20 +1783,21 @@ Canvas *TextRenderer::render_worker(
         }
 
         // Render the spell character.
-        render_rune(rendered_text, x, y, ch);
-        render_outline(rendered_text, x - 1, y - 1, FONT_W * 2 + 2, FONT_H + 2,
-                       RGBA{0, 0, 0, 128});
+        // Only runes between 0x40 and 0x7F are rendered. The rest are secret!
+        if (ch >= 0x40 && ch < 0x80) {
+          blit_tile(rendered_text, x, y, rune_tile(ch));
+        }
         x += FONT_W * 2;
         continue;
       }
 
       if (ch == 0x0f) {
-        current_color = color_scheme[DEFAULT_TEXT_COLOR];
+        current_color = DEFAULT_TEXT_COLOR;
         continue;
       }
 
       if (ch >= 0x10 && ch <= 0x1f) {
-        current_color = color_scheme[ch - 0x10];
+        current_color = ch - 0x10;
         continue;
       }
 
@@ -831,9 +1822,7 @@ Canvas *TextRenderer::render_worker(
       // Render the character (if it's a printable one).
       // Note: used font doesn't seem to have ~ character.
       if (ch >= 0x20 && ch <= 0x7d) {
-        render_char(rendered_text, x, y, ch, current_color);
-        render_outline(rendered_text, x - 1, y - 1, FONT_W + 2, FONT_H + 2,
-                       RGBA{0, 0, 0, 192});
+        blit_tile(rendered_text, x, y, char_tile(current_color, ch));
       }
       x += FONT_W;
     }
@@ -845,14 +1834,113 @@ Canvas *TextRenderer::render_worker(
     lines_rendered_counter = -lines_rendered_counter;
   }
 
-  // Add it to the cache.
-  CachedText *new_cached_text = new CachedText;
-  new_cached_text->lines_rendered = lines_rendered_counter;
-  new_cached_text->text = rendered_text;
-  cache_store(key, new_cached_text);
+  return lines_rendered_counter;
+}
 
-  *lines_rendered = lines_rendered_counter;
-  return rendered_text;
+void TextRenderer::build_atlas() {
+  // Ubuntu color scheme.
+  // https://en.wikipedia.org/wiki/ANSI_escape_code#3/4_bit
+  const RGBA color_scheme[ATLAS_COLORS] {
+    { 1,1,1,255 },
+    { 222,56,43,255 },
+    { 57,181,74,255 },
+    { 255,199,6,255 },
+    { 0,111,184,255 },
+    { 118,38,113,255 },
+    { 44,181,233,255 },
+    { 204,204,204,255 },
+    { 128,128,128,255 },
+    { 255,0,0,255 },
+    { 0,255,0,255 },
+    { 255,255,0,255 },
+    { 0,0,255,255 },
+    { 255,0,255,255 },
+    { 0,255,255,255 },
+    { 255,255,255,255 }
+  };
+
+  // One row of characters per color, and the runes in the last row.
+  atlas = std::make_unique<Canvas>(
+      std::max(ATLAS_CHARS * CHAR_TILE_W, ATLAS_RUNES * RUNE_TILE_W),
+      (ATLAS_COLORS + 1) * TILE_H);
+  atlas_tiles.clear();
+
+  for (int color = 0; color < ATLAS_COLORS; color++) {
+    for (int ch = 0x20; ch < 0x20 + ATLAS_CHARS; ch++) {
+      const int x = (ch - 0x20) * CHAR_TILE_W;
+      const int y = color * TILE_H;
+      render_char(atlas.get(), x + 1, y + 1, ch, color_scheme[color]);
+      render_outline(atlas.get(), x, y, CHAR_TILE_W, TILE_H,
+                     RGBA{0, 0, 0, 192});
+      atlas_tiles.push_back(x + y * atlas->w);
+    }
+  }
+
+  for (int rune = 0x40; rune < 0x40 + ATLAS_RUNES; rune++) {
+    const int x = (rune - 0x40) * RUNE_TILE_W;
+    const int y = ATLAS_COLORS * TILE_H;
+    render_rune(atlas.get(), x + 1, y + 1, rune);
+    render_outline(atlas.get(), x, y, RUNE_TILE_W, TILE_H,
+                   RGBA{0, 0, 0, 128});
+    atlas_tiles.push_back(x + y * atlas->w);
+  }
+
+  // Split each tile row into solid/outline runs, skipping what's empty.
+  atlas_runs.clear();
+  atlas_runs_index.clear();
+  for (size_t tile = 0; tile < atlas_tiles.size(); tile++) {
+    atlas_runs_index.push_back((uint32_t)atlas_runs.size());
+
+    const int tile_w =
+        tile < (size_t)rune_tile(0x40) ? CHAR_TILE_W : RUNE_TILE_W;
+    for (int j = 0; j < TILE_H; j++) {
+      const RGBA *px = &atlas->d[atlas_tiles[tile] + j * atlas->w];
+      for (int i = 0; i < tile_w; ) {
+        if (px[i].a == 0) {
+          i++;
+          continue;
+        }
+
+        const bool solid = px[i].a >= 200;
+        int end = i + 1;
+        while (end < tile_w && px[end].a != 0 &&
+               (px[end].a >= 200) == solid) {
+          end++;
+        }
+
+        atlas_runs.push_back(
+            GlyphRun{(uint8_t)i, (uint8_t)j, (uint8_t)(end - i), solid});
+        i = end;
+      }
+    }
+  }
+  atlas_runs_index.push_back((uint32_t)atlas_runs.size());
+}
+
+void TextRenderer::blit_tile(Canvas *dst, int x, int y, int tile) {
+  // Same result as drawing the glyph and then its outline: glyph pixels
+  // always win, the outline only goes where there is no glyph yet.
+  const RGBA *src = &atlas->d[atlas_tiles[tile]];
+  RGBA *dst_origin = &dst->d[(x - 1) + (y - 1) * dst->w];
+
+  const uint32_t first = atlas_runs_index[tile];
+  const uint32_t last = atlas_runs_index[tile + 1];
+  for (uint32_t k = first; k < last; k++) {
+    const GlyphRun& run = atlas_runs[k];
+    const RGBA *src_px = src + run.x + run.y * atlas->w;
+    RGBA *dst_px = dst_origin + run.x + run.y * dst->w;
+
+    if (run.solid) {
+      memcpy(dst_px, src_px, run.length * sizeof(RGBA));
+      continue;
+    }
+
+    for (int i = 0; i < run.length; i++) {
+      if (dst_px[i].a < 200) {
+        dst_px[i] = src_px[i];
+      }
+    }
+  }
 }
 
 void TextRenderer::render_char(
@@ -936,104 +2024,131 @@ void TextRenderer::render_outline(
 }
 
 
-std::string TextRenderer::cache_key(const std::string& text, int w, int h) {
-  std::string s;
-  s.resize(text.size() + 4);
-  text.copy(s.data() + 4, text.size(), 0);
+uint64_t TextRenderer::cache_key(const std::string& text, int w, int h) {
+  const uint64_t size = ((uint64_t)(uint16_t)w << 16) | (uint16_t)h;
+  return std::hash<std::string>{}(text) ^ (size * 0x9e3779b97f4a7c15ULL);
+}
+
+void TextRenderer::cache_remove(std::list<CachedText>::iterator entry) {
+  stats.entries--;
+  stats.bytes -= entry->canvas->d.capacity() * sizeof(RGBA);
+  cache.erase(entry->key);
+  pool.put(std::move(entry->canvas));
+  lru.erase(entry);
+}
 
-  uint16_t enc_w = uint16_t(w);
-  uint16_t enc_h = uint16_t(h);
-  memcpy(s.data() + 0, &enc_w, sizeof(uint16_t));
-  memcpy(s.data() + 2, &enc_h, sizeof(uint16_t));
+void TextRenderer::cache_trim() {
+  // The ones used in this frame might still be referenced (e.g. by the HUD
+  // layer until it's redrawn), so the budget is exceeded rather than that.
+  while (stats.bytes > CACHE_BUDGET && !lru.empty() &&
+         lru.back().frame != frame) {
+    cache_remove(std::prev(lru.end()));
+    stats.evictions++;
+  }
+}
 
-  return s;
+void Console::set_text_renderer(TextRenderer *txt) {
+  this->txt = txt;
 }
 
-TextRenderer::CachedText *TextRenderer::cache_get(const std::string& key) {
-  std::unordered_map<std::string, CachedText*>& current = cache[cache_current];
-  std::unordered_map<std::string, CachedText*>& next = cache[cache_current ^ 1];
+void Console::render_to(Canvas *dst, int x, int y) {
+  render_worker(dst, x, y);
+}
 
-  auto iter = current.find(key);
-  if (iter == current.end()) {
-    // Not is current cache. Check next cache.
-    iter = next.find(key);
-    if (iter == next.end()) {
-      // Not found either.
-      return nullptr;
-    }
+void Console::render_to(UILayer *dst, int x, int y) {
+  render_worker(dst, x, y);
+}
 
-    // Found in next cache, return it.
-    return iter->second;
+void Console::fade_strips() {
+  if (fadeout_time <= 0.0f) {
+    return;
   }
 
-  // Found in current cache. Move to the next cache and return.
-  CachedText *cached_text = iter->second;
-  next[key] = cached_text;
-  current.erase(iter);
+  auto time_now = std::chrono::steady_clock::now();
+  std::chrono::duration<float> diff = time_now - time_start;
+  float now = diff.count();
 
-  return cached_text;
-}
+  // Newest first. The ones not fading yet are skipped, and the loop stops at
+  // the first one which is gone already (all the older ones are too).
+  for (size_t k = strips_count; k-- > 0; ) {
+    Strip& strip = strips[(strips_first + k) % strips.size()];
+    if (strip.c == nullptr) {
+      break;  // Already gone, and so are all the older ones.
+    }
 
-void TextRenderer::cache_store(const std::string& key, CachedText *rendered_text) {
-  std::unordered_map<std::string, CachedText*>& next = cache[cache_current ^ 1];
-  next[key] = rendered_text;
-}
+    const float deadline = strip.time + fadeout_time;
+    if (now < deadline) {
+      continue;
+    }
 
-void Console::set_text_renderer(TextRenderer *txt) {
-  this->txt = txt;
-}
+    // Fadeout or set inactive.
+    float diff = now - deadline;
+    uint8_t a = 0;
+    if (diff <= 1.0f) {
+      a = (127 - uint8_t(diff * 127.0f)) & 0xf0;
+    }
 
-void Console::render_to(Canvas *dst, int x, int y) {
-  // Fade out scanlines if needed.
-  if (fadeout_time > 0.0f) {
-    auto time_now = std::chrono::steady_clock::now();
-    std::chrono::duration<float> diff = time_now - time_start;
-    float now = diff.count();
-
-    // Go form the end - this way the loop can stop early when it reaches the
-    // lines that are already on float::max.
-    for (int j = int(line_time.size()) - 1; j >= 0; j--) {
-
-      // Line still active or already in inactive state.
-      const float deadline = line_time[j] + fadeout_time;
-      if (now < deadline) {
-        // OK, this check is kinda crazy due to the addition a few lines back.
-        // However, due to the way float works, float::max + a decently small
-        // number (well, actually it can be really big) gives float::max. So
-        // it's fine. A hack, but still fine.
-        if (deadline == std::numeric_limits<float>::max()) {
-          break;
-        }
+    if (a == strip.alpha) {
+      continue;
+    }
 
-        continue;
-      }
+    strip.alpha = a;
+    if (a == 0) {
+      pool.put(std::move(strip.c));
+    }
+    composed = false;
+  }
+}
 
-      // Fadeout or set inactive.
-      float diff = now - deadline;
-      uint8_t a = 0;
+void Console::compose() {
+  std::fill(c.d.begin(), c.d.end(), RGBA{0, 0, 0, 0});
 
-      if (diff > 1.0f) {
-        line_time[j] = std::numeric_limits<float>::max();
-      } else {
-        a = (127 - uint8_t(diff * 127.0f)) & 0xf0;
+  // Bottom up, the newest strip is the last line of the console.
+  int y = (int)c.h;
+  for (size_t k = strips_count; k-- > 0 && y > 0; ) {
+    const Strip& strip = strips[(strips_first + k) % strips.size()];
+    y -= strip.h;
+    if (strip.c == nullptr) {
+      continue;
+    }
+
+    for (int j = std::max(0, -y); j < strip.h; j++) {
+      const RGBA *src = &strip.c->d[j * strip.c->w];
+      RGBA *dst = &c.d[(y + j) * c.w];
+      if (strip.alpha == 255) {
+        memcpy(dst, src, c.w * sizeof(RGBA));
+        continue;
       }
 
       for (unsigned int i = 0; i < c.w; i++) {
-        RGBA& px = c.d[i + j * c.w];
-        if (px.a == 0) {
-          continue;
+        dst[i] = src[i];
+        if (dst[i].a != 0) {
+          dst[i].a = strip.alpha;
         }
-        px.a = a;
       }
     }
   }
 
+  composed = true;
+  revision++;
+}
+
+template<typename T> void Console::render_worker(T *dst, int x, int y) {
+  fade_strips();
+  if (!composed) {
+    compose();
+  }
+
   // Render.
   if (show_input_prompt) {
     const int input_height = FONT_H + 2;
-    dst->blit(&c, 0, input_height, x, y, c.w, c.h - input_height);
-    txt->printf(dst, x, y + c.h - input_height, c.w, input_height,
-                "\x13" "%s", prompt.c_str());
+    if constexpr (std::is_same_v<T, UILayer>) {
+      dst->blit(&c, 0, input_height, x, y, c.w, c.h - input_height, revision);
+    } else {
+      dst->blit(&c, 0, input_height, x, y, c.w, c.h - input_height);
+    }
+    txt->render(dst, x, y + c.h - input_height, c.w, input_height,
+                "\x13" + prompt);
 
     // Let's hope prompt never has rune markers, nor does input.
     // TODO: Something to fix.
@@ -1058,6 +2173,8 @@ void Console::render_to(Canvas *dst, int x, int y) {
     txt->render(dst, x + prompt_width, y + c.h - input_height,
                 c.w - prompt_width, input_height,
                 to_show);
+  } else if constexpr (std::is_same_v<T, UILayer>) {
+    dst->blit(&c, x, y, revision);
   } else {
     dst->blit(&c, x, y);
   }
@@ -1065,7 +2182,7 @@ void Console::render_to(Canvas *dst, int x, int y) {
 
 void Console::puts(const std::string& s) {
   // Render to temporary canvas.
-  int line_no = txt->render(&tmp, 0, 0, tmp.w, tmp.h, s);
+  int line_no = txt->render_uncached(&tmp, tmp.w, tmp.h, s);
 
   // In case not everything rendered. Oh well, too bad.
   if (line_no < 0) {
@@ -1078,29 +2195,35 @@ void Console::puts(const std::string& s) {
     height = int(c.h);
   }
 
-  int dst_y = c.h - height;
-  if (dst_y < 0) {
-    dst_y = 0;
-  }
-
   //printf("'%s' --> %i lines, %i pixels\n", s.c_str(), line_no, height);
 
-  memmove(c.d.data(), c.d.data() + height * c.w,
-          (c.d.size() - height * c.w) * sizeof(RGBA));
-
-  memmove(line_time.data(), line_time.data() + height,
-          (line_time.size() - height) * sizeof(float));
+  // Drop the strips which are scrolled out completely now.
+  while (strips_count > 0 &&
+         strips_height + height - strips[strips_first].h >= int(c.h)) {
+    Strip& oldest = strips[strips_first];
+    if (oldest.c != nullptr) {
+      pool.put(std::move(oldest.c));
+    }
+    strips_height -= oldest.h;
+    strips_first = (strips_first + 1) % strips.size();
+    strips_count--;
+  }
 
   const auto time_now = std::chrono::steady_clock::now();
   const std::chrono::duration<float> diff = time_now - time_start;
   const float now = diff.count();
-  std::fill(line_time.begin() + dst_y, line_time.end(), now);
 
-  // Copy the pixel data.
-  c.copy(&tmp, 0, 0, 0, dst_y, tmp.w, height);
+  // Same as rendering the text straight over the console (blended, that is).
+  Strip& strip = strips[(strips_first + strips_count) % strips.size()];
+  strip = Strip{pool.get(tmp.w, height), height, now, 255};
+  strip.c->blit(&tmp, 0, 0, 0, 0, tmp.w, height);
+  strips_height += height;
+  strips_count++;
 
   // Clear the temporary canvas.
   std::fill(tmp.d.begin(), tmp.d.begin() + height * tmp.w, RGBA{0, 0, 0, 0});
+
+  composed = false;
 }
 
 void Console::set_prompt(const std::string& new_prompt, bool show) {
@@ -1139,7 +2262,7 @@ bool Engine::load_textures() {
 }
 
 void Engine::pregenerate_texture(const std::string& gfx_id) {
-  auto item = item_to_sprite_info(gfx_id);
+  const auto& item = item_to_sprite_info(gfx_id);
   if (!item.is_sprite) {
     return;  // Not needed.
   }
@@ -1153,12 +2276,33 @@ void Engine::pregenerate_texture(const std::string& gfx_id) {
 }
 
 bool Engine::initialize() {
+  // The camera only ever moves tile by tile and turns by 90 degrees, so the
+  // projected geometry repeats from frame to frame.
+  r3d.projection_cache_enable = true;
+
   if (!load_textures()) {
     puts("error: texture load failed");
     return false;
   }
 
+  if (downscale > 1) {
+    // The 3D view is rendered into a smaller canvas (see render_scene), so it
+    // needs a smaller sky too.
+    low_c = std::make_unique<Canvas>(r3d.width, r3d.height);
+    low_sky = std::make_unique<Canvas>(r3d.width, r3d.height);
+
+    const Canvas *sky = img.get("3d_sky");
+    for (int j = 0; j < r3d.height; j++) {
+      for (int i = 0; i < r3d.width; i++) {
+        low_sky->d[i + j * r3d.width] =
+            sky->d[i * downscale + j * downscale * sky->w];
+      }
+    }
+  }
+
   init_sprite_map();  // Note: This must happen after load_textures.
+  init_tile_textures();  // Same.
+  init_ui_textures();
   auto keys = item_sprite_map_keys();
   for (const auto& k : keys) {
     pregenerate_texture(k);
@@ -1178,33 +2322,99 @@ bool Engine::initialize() {
     return false;
   }
 
+  create_bands();
   return true;
 }
 
-void Engine::tile_grassland(int stage, float x, float z, WorldMap::Tile t) {
-  if (stage != 1) return;
+namespace {
+
+struct TreeType {
+  float w;
+  float h;
+  float y_offset;
+  const char *texture;
+};
+
+const TreeType TREE_TYPES[] = {
+  { 2.15f * 2.0f, 4.30f * 2.0f, 0.1f, "3d_pinetree1" }, // 0
+  { 2.31f * 2.0f, 4.70f * 2.0f, 0.1f, "3d_pinetree2" }, // 1
+  { 2.23f * 2.0f, 5.93f * 2.0f, 0.1f, "3d_pinetree3" }, // 2
+  { 1.92f * 2.0f, 3.12f * 2.0f, 0.1f, "3d_pinetree4" }, // 3
+  { 1.92f * 2.0f, 3.12f * 2.0f, 0.1f, "3d_pinetree5" }, // 4
+
+  { 4.00f * 2.0f, 6.00f * 2.0f, 0.1f, "3d_tree_leaf_huge" },      // 5
+  { 2.53f * 2.0f, 3.45f * 2.0f, 0.1f, "3d_tree_leaf_large" },     // 6
+  { 2.89f * 2.0f, 4.00f * 2.0f, 0.1f, "3d_tree_leaf_medium" },    // 7
+  { 2.50f * 2.0f, 4.10f * 2.0f, 0.1f, "3d_tree_leaf_medium2" },   // 8
+  { 3.75f * 2.0f, 5.07f * 2.0f, 0.1f, "3d_tree_leaf_verylarge" }, // 9
+
+  { 1.82f * 2.0f, 0.80f * 2.0f, 0.1f, "3d_bush1" }, // 10
+  { 1.43f * 2.0f, 0.81f * 2.0f, 0.1f, "3d_bush2" }, // 11
+  { 1.40f * 2.0f, 1.14f * 2.0f, 0.1f, "3d_bush3" }, // 12
+
+  { 1.42f * 2.0f, 1.70f * 2.0f, 0.1f, "3d_deadtree1" }, // 13
+  { 1.63f * 2.0f, 2.64f * 2.0f, 0.1f, "3d_deadtree2" }, // 14
+  { 2.12f * 2.0f, 3.00f * 2.0f, 0.1f, "3d_deadtree3" }, // 15
+};
+
+}  // namespace
+
+void Engine::init_tile_textures() {
+  auto& tt = tile_textures;
+  tt.grass[0] = img.handle("3d_grassA");
+  tt.grass[1] = img.handle("3d_grassB");
+  tt.grass[2] = img.handle("3d_grassC");
+  tt.grass[3] = img.handle("3d_grassD");
+  tt.water[0] = img.handle("3d_waterA");
+  tt.water[1] = img.handle("3d_waterB");
+  tt.water[2] = img.handle("3d_waterC");
+  tt.water[3] = img.handle("3d_waterD");
+  tt.rock = img.handle("3d_rock");
+  tt.rock_dark = img.handle("3d_rockD");
+  tt.rock_light = img.handle("3d_rockL");
+  tt.sand[0] = img.handle("3d_sandA");
+  tt.sand[1] = img.handle("3d_sandB");
+  tt.sand[2] = img.handle("3d_sandC");
+  tt.sand[3] = img.handle("3d_sandD");
+  tt.rocky_road[0] = img.handle("3d_rocky_roadA");
+  tt.rocky_road[1] = img.handle("3d_rocky_roadB");
+  tt.rocky_road[2] = img.handle("3d_rocky_roadC");
+  tt.rocky_road[3] = img.handle("3d_rocky_roadD");
+  tt.dirt[0] = img.handle("3d_dirtA");
+  tt.dirt[1] = img.handle("3d_dirtB");
+  tt.dirt[2] = img.handle("3d_dirtC");
+  tt.dirt[3] = img.handle("3d_dirtD");
+  tt.wall = img.handle("3d_wall");
+  tt.wall_door = img.handle("3d_wall_door");
+  tt.wood = img.handle("3d_wood");
+
+  tt.trees.clear();
+  for (const auto& type : TREE_TYPES) {
+    tt.trees.push_back(img.handle(type.texture));
+  }
+}
 
-  r3d.tile(
+void Engine::tile_grassland(
+    DisplayList *dl, float x, float z, WorldMap::Tile t) {
+  dl->tile(
+      1,  // Stage.
       Coords3D{x, 0.0f, z},  // Tile position.
       Coords3D{TILE_SZ * 1.25f, 0.0f, TILE_SZ * 1.25f},  // Tile size.
-      (const char*[4]){
-          "3d_grassA", "3d_grassB", "3d_grassC", "3d_grassD"}[t.variant & 3]);
+      tile_textures.grass[t.variant & 3]);
 }
 
-void Engine::tile_water(int stage, float x, float z, WorldMap::Tile t) {
-  if (stage != 0) return;
-
+void Engine::tile_water(
+    DisplayList *dl, float x, float z, WorldMap::Tile t) {
   (void)t;
-  r3d.tile(
+  dl->tile(
+      0,  // Stage.
       Coords3D{x, 0.0f, z},  // Tile position.
       Coords3D{TILE_SZ, 0.0f, TILE_SZ},  // Tile size.
-      (const char*[4]){
-          "3d_waterA", "3d_waterB", "3d_waterC", "3d_waterD"}[t.variant & 3]);
+      tile_textures.water[t.variant & 3]);
 }
 
-void Engine::tile_mountains(int stage, float x, float z, WorldMap::Tile t) {
-  if (stage != 4) return;
-
+void Engine::tile_mountains(
+    DisplayList *dl, float x, float z, WorldMap::Tile t) {
   float height = -2.0f;
   if ((t.variant & 0x80) == 0) {
     height -= (float(t.variant) / 127.0f) * 12.7f * 3.0f;
@@ -1225,69 +2435,37 @@ void Engine::tile_mountains(int stage, float x, float z, WorldMap::Tile t) {
   };
 
   if (x > 0) {
-    r3d.vquad(points[0], points[5], "3d_rockD");
+    dl->vquad(4, points[0], points[5], tile_textures.rock_dark);
   }
 
   if (x < 0) {
-    r3d.vquad(points[3], points[6], "3d_rockL");
+    dl->vquad(4, points[3], points[6], tile_textures.rock_light);
   }
 
-  r3d.vquad(points[0], points[7], "3d_rock");
+  dl->vquad(4, points[0], points[7], tile_textures.rock);
 }
 
-void Engine::tile_sand(int stage, float x, float z, WorldMap::Tile t) {
-  if (stage != 2) return;
-
+void Engine::tile_sand(
+    DisplayList *dl, float x, float z, WorldMap::Tile t) {
   (void)t;
-  r3d.tile(
+  dl->tile(
+      2,  // Stage.
       Coords3D{x, 0.0f, z},  // Tile position.
       Coords3D{TILE_SZ * 1.25f, 0.0f, TILE_SZ * 1.25f},  // Tile size.
-      (const char*[4]){
-          "3d_sandA", "3d_sandB", "3d_sandC", "3d_sandD"}[t.variant & 3]);
+      tile_textures.sand[t.variant & 3]);
 }
 
-void Engine::tile_forest(int stage, float x, float z, WorldMap::Tile t) {
+void Engine::tile_forest(
+    DisplayList *dl, float x, float z, WorldMap::Tile t) {
   (void)t;
 
-  if (stage == 1) {
-    tile_grassland(stage, x, z, WorldMap::Tile{1, uint8_t(t.variant >> 3)});
-    return;
-  }
-
-  if (stage != 4) return;
+  tile_grassland(dl, x, z, WorldMap::Tile{1, uint8_t(t.variant >> 3)});
 
   // Do not render trees at coordinates z=0 (they would block the view).
   if (z < TILE_SZ / 2.0f) {
     return;
   }
 
-  static const struct tree_type_t {
-    float w;
-    float h;
-    float y_offset;
-    const char *texture;
-  } types[] = {
-    { 2.15f * 2.0f, 4.30f * 2.0f, 0.1f, "3d_pinetree1" }, // 0
-    { 2.31f * 2.0f, 4.70f * 2.0f, 0.1f, "3d_pinetree2" }, // 1
-    { 2.23f * 2.0f, 5.93f * 2.0f, 0.1f, "3d_pinetree3" }, // 2
-    { 1.92f * 2.0f, 3.12f * 2.0f, 0.1f, "3d_pinetree4" }, // 3
-    { 1.92f * 2.0f, 3.12f * 2.0f, 0.1f, "3d_pinetree5" }, // 4
-
-    { 4.00f * 2.0f, 6.00f * 2.0f, 0.1f, "3d_tree_leaf_huge" },      // 5
-    { 2.53f * 2.0f, 3.45f * 2.0f, 0.1f, "3d_tree_leaf_large" },     // 6
-    { 2.89f * 2.0f, 4.00f * 2.0f, 0.1f, "3d_tree_leaf_medium" },    // 7
-    { 2.50f * 2.0f, 4.10f * 2.0f, 0.1f, "3d_tree_leaf_medium2" },   // 8
-    { 3.75f * 2.0f, 5.07f * 2.0f, 0.1f, "3d_tree_leaf_verylarge" }, // 9
-
-    { 1.82f * 2.0f, 0.80f * 2.0f, 0.1f, "3d_bush1" }, // 10
-    { 1.43f * 2.0f, 0.81f * 2.0f, 0.1f, "3d_bush2" }, // 11
-    { 1.40f * 2.0f, 1.14f * 2.0f, 0.1f, "3d_bush3" }, // 12
-
-    { 1.42f * 2.0f, 1.70f * 2.0f, 0.1f, "3d_deadtree1" }, // 13
-    { 1.63f * 2.0f, 2.64f * 2.0f, 0.1f, "3d_deadtree2" }, // 14
-    { 2.12f * 2.0f, 3.00f * 2.0f, 0.1f, "3d_deadtree3" }, // 15
-  };
-
   static const struct tree_set_t {
     int type[10];
   } sets[] = {
@@ -1321,7 +2499,7 @@ void Engine::tile_forest(int stage, float x, float z, WorldMap::Tile t) {
 
   for (uint8_t i = 0; i < tree_count; i++) {
     const int tree_type_idx = set.type[(i + set_offset) % 10];
-    const struct tree_type_t& tree = types[tree_type_idx];
+    const TreeType& tree = TREE_TYPES[tree_type_idx];
     const struct tree_slot_t& slot = slot_set[i];
 
     const Coords3D tree_pos{
@@ -1345,42 +2523,39 @@ void Engine::tile_forest(int stage, float x, float z, WorldMap::Tile t) {
         tree_pos.z + z
     };
 
-    r3d.vquad(bottom_left, top_right, tree.texture);
+    dl->vquad(4, bottom_left, top_right, tile_textures.trees[tree_type_idx]);
   }
 }
 
-void Engine::tile_rocky_road(int stage, float x, float z, WorldMap::Tile t) {
-  if (stage != 2) return;
-
-  r3d.tile(
+void Engine::tile_rocky_road(
+    DisplayList *dl, float x, float z, WorldMap::Tile t) {
+  dl->tile(
+      2,  // Stage.
       Coords3D{x, 0.0f, z},  // Tile position.
       Coords3D{TILE_SZ * 1.25f, 0.0f, TILE_SZ * 1.25f},  // Tile size.
-      (const char*[4]){"3d_rocky_roadA", "3d_rocky_roadB",
-                       "3d_rocky_roadC", "3d_rocky_roadD"}[t.variant & 3]);
+      tile_textures.rocky_road[t.variant & 3]);
 
   if ((t.variant & 0x80)) {
-    r3d.tile(
+    dl->tile(
+        2,  // Stage.
         Coords3D{x, -3.0f, z},  // Tile position.
         Coords3D{TILE_SZ * 1.25f, -3.0f, TILE_SZ * 1.25f},  // Tile size.
-        (const char*[4]){"3d_rocky_roadA", "3d_rocky_roadB",
-                         "3d_rocky_roadC", "3d_rocky_roadD"}[(t.variant+1) & 3]);
+        tile_textures.rocky_road[(t.variant+1) & 3]);
   }
 }
 
-void Engine::tile_dirt_road(int stage, float x, float z, WorldMap::Tile t) {
-  if (stage != 3) return;
-
+void Engine::tile_dirt_road(
+    DisplayList *dl, float x, float z, WorldMap::Tile t) {
   (void)t;
-  r3d.tile(
+  dl->tile(
+      3,  // Stage.
       Coords3D{x, 0.00f, z},  // Tile position.
       Coords3D{TILE_SZ * 1.35f, 0.0f, TILE_SZ * 1.35f},  // Tile size.
-      (const char*[4]){
-          "3d_dirtA", "3d_dirtB", "3d_dirtC", "3d_dirtD"}[t.variant & 3]);
+      tile_textures.dirt[t.variant & 3]);
 }
 
-void Engine::tile_stone_wall(int stage, float x, float z, WorldMap::Tile t) {
-  if (stage != 4) return;
-
+void Engine::tile_stone_wall(
+    DisplayList *dl, float x, float z, WorldMap::Tile t) {
   const Coords3D points[] = {
     // Top (clockwise).
     { x - TILE_SZ * 0.5f, -3.0f, z - TILE_SZ * 0.5f },
@@ -1395,23 +2570,25 @@ void Engine::tile_stone_wall(int stage, float x, float z, WorldMap::Tile t) {
     { x + TILE_SZ * 0.5f, 0.0f, z - TILE_SZ * 0.5f }
   };
 
-  r3d.vquad(points[0], points[5], t.variant == 0xff ? "3d_wall_door" : "3d_wall");
-  r3d.vquad(points[3], points[6], t.variant == 0xff ? "3d_wall_door" : "3d_wall");
-  r3d.vquad(points[0], points[7], t.variant == 0xff ? "3d_wall_door" : "3d_wall");
+  const texture_handle_t texture = t.variant == 0xff ?
+      tile_textures.wall_door : tile_textures.wall;
+  dl->vquad(4, points[0], points[5], texture);
+  dl->vquad(4, points[3], points[6], texture);
+  dl->vquad(4, points[0], points[7], texture);
 }
 
-void Engine::tile_wood_floor(int stage, float x, float z, WorldMap::Tile t) {
-  if (stage != 1) return;
-
+void Engine::tile_wood_floor(
+    DisplayList *dl, float x, float z, WorldMap::Tile t) {
   (void)t;
-  r3d.tile(
+  dl->tile(
+      1,  // Stage.
       Coords3D{x, 0.0f, z},  // Tile position.
       Coords3D{TILE_SZ, 0.0f, TILE_SZ},  // Tile size.
-      "3d_wood");
+      tile_textures.wood);
 }
 
 void Engine::render_mobs_at(
-    GameState *state,
+    DisplayList *dl, GameState *state,
     int map_x, int map_y, float x, float z, bool standing_on) {
   const auto iter = state->ground_mobs.find(GameState::coords_to_key(map_x, map_y));
   if (iter == state->ground_mobs.end()) {
@@ -1432,17 +2609,17 @@ void Engine::render_mobs_at(
   float space = (slots_width) / float(mobs_count);
   float offset_x = -slots_width * 0.5f;
 
-  r3d.itembuffer_enable = true;
+  dl->pickable = true;
   for (const auto& mob : mobs) {
-    r3d.itemid = mob.id | MOB_MASK;
+    dl->itemid = mob.id | MOB_MASK;
 
     float x3d = (0.0f + offset_x);
     float y3d = (-0.01f);
     float z3d = standing_on ? TILE_SZ * 0.5f - 0.3f : 0.0f;
 
-    Canvas *c = img.get(mob.gfx_id);
-    float w3d = float(c->w) * 0.015f;
-    float h3d = float(c->h) * 0.015f;
+    const SpriteInfo& info = mob_sprite(mob.gfx_handle);
+    float w3d = info.w3d;
+    float h3d = info.h3d;
 
     Coords3D bottom_left{
         x - w3d * 0.5f + x3d,
@@ -1456,16 +2633,60 @@ void Engine::render_mobs_at(
         z + z3d
     };
 
-    r3d.vquad(bottom_left, top_right, mob.gfx_id);
+    dl->sprite(bottom_left, top_right, mob.gfx_handle);
 
     offset_x += space;
   }
 
-  r3d.itembuffer_enable = false;
+  dl->pickable = false;
+}
+
+const Engine::SpriteInfo& Engine::item_sprite(texture_handle_t h) {
+  static const SpriteInfo missing{};
+  if (img.get(h) == nullptr) {
+    return missing;  // The display list will complain about it.
+  }
+
+  if (h >= item_sprites.size()) {
+    item_sprites.resize(h + 1);
+  }
+
+  SpriteInfo& sprite = item_sprites[h];
+  if (!sprite.valid) {
+    const auto& info = item_to_sprite_info(img.id(h));
+    sprite = SpriteInfo{
+        true, info.w3d, info.h3d,
+        info.has_position, info.x3d, info.y3d, info.z3d
+    };
+  }
+
+  return sprite;
+}
+
+const Engine::SpriteInfo& Engine::mob_sprite(texture_handle_t h) {
+  static const SpriteInfo missing{};
+  const Canvas *c = img.get(h);
+  if (c == nullptr) {
+    return missing;
+  }
+
+  if (h >= mob_sprites.size()) {
+    mob_sprites.resize(h + 1);
+  }
+
+  SpriteInfo& sprite = mob_sprites[h];
+  if (!sprite.valid) {
+    sprite = SpriteInfo{
+        true, float(c->w) * 0.015f, float(c->h) * 0.015f,
+        false, 0.0f, 0.0f, 0.0f
+    };
+  }
+
+  return sprite;
 }
 
 void Engine::render_items_at(
-    GameState *state,
+    DisplayList *dl, GameState *state,
     int map_x, int map_y, float x, float z, bool standing_on) {
   const auto iter = state->ground_items.find(GameState::coords_to_key(map_x, map_y));
   if (iter == state->ground_items.end()) {
@@ -1490,10 +2711,10 @@ void Engine::render_items_at(
 
   float offset_x = -slots_width * 0.5f;
 
-  r3d.itembuffer_enable = true;
+  dl->pickable = true;
   for (const auto& item : items) {
-    auto info = item_to_sprite_info(item.gfx_id);
-    r3d.itemid = item.id;
+    const SpriteInfo& info = item_sprite(item.gfx_handle);
+    dl->itemid = item.id;
 
     float x3d = (info.has_position ? info.x3d : 0.0f + offset_x);
     float y3d = (info.has_position ? info.y3d : -0.01f);
@@ -1513,224 +2734,688 @@ void Engine::render_items_at(
 
     //sprintf("--> '%s' '%s'\n", item.gfx_id.c_str(), item.name.c_str());
 
-    r3d.vquad(bottom_left, top_right, item.gfx_id);
+    dl->sprite(bottom_left, top_right, item.gfx_handle);
 
     offset_x += space;
   }
 
-  r3d.itembuffer_enable = false;
+  dl->pickable = false;
 }
 
-void Engine::render_at(GameState *state, int x, int y, int dir) {
+const Canvas *Engine::render_at(GameState *state, int x, int y, int dir) {
   auto tm_start = clock();
 
-  r3d.zbuffer_reset();
-  r3d.zbuffer_ignore = false;
+  SceneKey key{
+      x, y, dir, world.revision, ground_stamp(state, x, y), view_distance};
+  auto entry = frame_cache_find(key);
+  if (entry == frame_cache.end()) {
+    const auto render_start = std::chrono::steady_clock::now();
+    entry = render_scene(state, key, /*speculative=*/false);
+    if (entry == frame_cache.end()) {
+      return nullptr;
+    }
+
+    // Cache hits say nothing about the cost of a frame, so only actual
+    // renders count.
+    if (governor.budget_ms > 0.0f) {
+      const std::chrono::duration<float, std::milli> render_time =
+          std::chrono::steady_clock::now() - render_start;
+      govern_view_distance(render_time.count());
+    }
+  }
 
-  r3d.itembuffer_reset();
-  r3d.itembuffer_enable = false;
-  r3d.itemid = ITEM_NON_EXISTING_ID;
+  // The current frame is always in front (see item_at()).
+  frame_cache.splice(frame_cache.begin(), frame_cache, entry);
 
-  // TODO fix fog.
-  if (y >= 512 && y <= 700) {
-    r3d.fog_setup(true, RGBA{0, 0, 0, 0}, 5.0f);
-    std::fill(c.d.begin(), c.d.end(), RGBA{0, 0, 0, 255});
-  } else {
-    r3d.fog_setup(true, RGBA{128, 168, 255, 255}, 1.0f);
-    c.copy_fast(img.get("3d_sky"));
+  auto tm_end = clock();
+
+  auto tm_diff = tm_end - tm_start;
+  float spf = float(tm_diff) / float(CLOCKS_PER_SEC);
+  float fps = 1.0f / spf;
+  (void)fps;
+  //printf("%f sec (%.1f FPS)\n", spf, fps);
+
+  return &entry->frame;
+}
+
+bool Engine::prerender(GameState *state) {
+  if (state->game_scene != GameState::SCENE_GAME) {
+    return false;
+  }
+
+  const int x = state->player_x;
+  const int y = state->player_y;
+  const int dir = state->player_dir;
+  if (dir < NORTH || dir > EAST) {
+    return false;
+  }
+
+  auto& done = prerender_done;
+  if (done.valid && done.x == x && done.y == y && done.dir == dir &&
+      done.world_revision == world.revision &&
+      done.ground_revision == state->ground_revision) {
+    return false;
   }
 
+  // Indexed by direction (NORTH, SOUTH, WEST, EAST).
+  static const int turn_left[] = { WEST, EAST, SOUTH, NORTH };
+  static const int turn_right[] = { EAST, WEST, NORTH, SOUTH };
+  static const Coords forward[] = { {0, -1}, {0, 1}, {-1, 0}, {1, 0} };
+
+  // Most likely first. Only one view is rendered per call, so that the game
+  // thread doesn't get stuck here when events start coming in.
+  const SceneKey candidates[] = {
+    { x, y, turn_left[dir], 0, 0, 0 },
+    { x, y, turn_right[dir], 0, 0, 0 },
+    { x + forward[dir].x, y + forward[dir].y, dir, 0, 0, 0 }
+  };
+
+  for (SceneKey key : candidates) {
+    key.world_revision = world.revision;
+    key.ground_stamp = ground_stamp(state, key.x, key.y);
+    key.view_distance = view_distance;
+    if (frame_cache_find(key) != frame_cache.end()) {
+      continue;
+    }
+
+    render_scene(state, key, /*speculative=*/true);
+    return true;
+  }
+
+  done = {x, y, dir, world.revision, state->ground_revision, true};
+  return false;
+}
+
+std::list<Engine::FrameCacheEntry>::iterator Engine::render_scene(
+    GameState *state, const SceneKey& key, bool speculative) {
   Coords iter_external;
   Coords iter_internal;
 
-  if (dir == NORTH) {
+  if (key.dir == NORTH) {
     iter_external.x = 0; iter_external.y = 1;
     iter_internal.x = 1; iter_internal.y = 0;
-  } else if (dir == SOUTH) {
+  } else if (key.dir == SOUTH) {
     iter_external.x = 0; iter_external.y = -1;
     iter_internal.x = -1; iter_internal.y = 0;
-  } else if (dir == WEST) {
+  } else if (key.dir == WEST) {
     iter_external.x = 1; iter_external.y = 0;
     iter_internal.x = 0; iter_internal.y = -1;
-  } else if (dir == EAST) {
+  } else if (key.dir == EAST) {
     iter_external.x = -1; iter_external.y = 0;
     iter_internal.x = 0; iter_internal.y = 1;
   } else {
     puts("warning: wrong direction?");
-    return;
+    return frame_cache.end();
+  }
+
+  // Render straight into the cache entry. Speculative frames don't touch the
+  // current one (which stays in front).
+  auto entry = frame_cache_new_entry(speculative);
+  entry->key = key;
+
+  // Lower resolutions are rendered on the side and scaled up afterwards.
+  Canvas *dst = low_c != nullptr ? low_c.get() : &entry->frame;
+
+  // TODO fix fog.
+  if (key.y >= 512 && key.y <= 700) {
+    std::fill(dst->d.begin(), dst->d.end(), RGBA{0, 0, 0, 255});
+  } else {
+    dst->copy_fast(low_c != nullptr ? low_sky.get() : img.get("3d_sky"));
   }
 
-  // TODO: Perhaps do a display list out of this stuff? Might actually be faster.
+  if (!scene_valid || !(key == scene_key)) {
+    build_display_list(
+        &scene, state, key.x, key.y, iter_external, iter_internal);
+    scene_key = key;
+    scene_valid = true;
+  }
 
-  for (int stage = 0; stage < 5; stage++) {
+  r3d.c = dst;
+  for (auto& band : bands) {
+    band->c = dst;
+  }
 
-    r3d.zbuffer_ignore = (stage < 4);
+  if (bands.empty()) {
+    render_view(&r3d, &scene, key.y, speculative);
+  } else {
+    // Every band owns a disjoint set of canvas/zbuffer rows, so the workers
+    // don't need to synchronize with each other at all. The calling thread
+    // takes the first band.
+    {
+      std::lock_guard<std::mutex> lock(band_mutex);
+      band_job = BandJob{&scene, key.y, speculative};
+      band_pending = (int)bands.size() - 1;
+      band_frame++;
+    }
+    band_job_cv.notify_all();
 
-    // The last stage needs to be drawn in reverse order to use the Z-buffer
-    // in the fullest.
-    const int j_start = (stage < 4) ? VIEWING_DISTANCE : 0;
-    const int j_end = (stage < 4) ? -1 : VIEWING_DISTANCE + 1;
-    const int j_vector = (stage < 4) ? -1 : +1;
+    render_view(bands[0].get(), &scene, key.y, speculative);
 
-    for (int j = j_start; j != j_end; j += j_vector) {
+    std::unique_lock<std::mutex> lock(band_mutex);
+    band_done_cv.wait(lock, [this]{ return band_pending == 0; });
+  }
 
-      // Calculate the view cone.
-      const int bx = (int)(((float)j * 3.0f + 3.0f) / 2.0f);
+  if (low_c != nullptr) {
+    entry->frame.scale_up(low_c.get(), downscale);
+  }
 
-      for (int i = -bx; i <= bx; i++) {
-        const float x3D = (float)i * TILE_SZ;
-        const float z3D = (float)j * TILE_SZ - PLAYER_Z;
+  frame_cache_collect_picks(&*entry);
+  return entry;
+}
 
-        int map_x = x + iter_internal.x * i - iter_external.x * j;
-        int map_y = y + iter_internal.y * i - iter_external.y * j;
+uint64_t Engine::ground_stamp(GameState *state, int x, int y) {
+  for (const auto& memo : ground_stamp_memo) {
+    if (memo.valid && memo.x == x && memo.y == y &&
+        memo.ground_revision == state->ground_revision) {
+      return memo.stamp;
+    }
+  }
 
-        uint8_t default_tile_type = (stage == 0) ? 2 /* water */ : 0 /* nothing */;
-        WorldMap::Tile t{default_tile_type, 0};
-        if (map_x >= 0 && map_x < WORLD_W &&
-            map_y >= 0 && map_y < WORLD_H) {
-          const size_t idx = map_x + map_y * WORLD_W;
-          t = world.tiles[idx];
-        }
+  if (!ground_hashes_valid ||
+      ground_hashes_revision != state->ground_revision) {
+    auto mix = [](uint64_t h) {  // splitmix64 finalizer.
+      h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+      return h ^ (h >> 31);
+    };
 
-        switch (t.type) {
-          case 0: break;  // Nothing.
-          case 1: tile_grassland(stage, x3D, z3D, t); break;
-          case 2: tile_water(stage, x3D, z3D, t); break;
-          case 3: tile_mountains(stage, x3D, z3D, t); break;
-          case 4: tile_sand(stage, x3D, z3D, t); break;
-          case 5: tile_forest(stage, x3D, z3D, t); break;
-          case 6: {
-            t.variant &= 0x7f;
-            if (map_y >= 512) {
-              t.variant |= 0x80;
-            }
-            tile_rocky_road(stage, x3D, z3D, t);
-          } break;
-          case 7: tile_dirt_road(stage, x3D, z3D, t); break;
-          case 8: {
-            auto pos = GameState::coords_to_key(map_x, map_y);
-            t.variant = 0;
-            if (state->ground_items.find(pos) != state->ground_items.end()) {
-              t.variant = 0xff;
-            }
+    ground_hashes.clear();
+    for (const auto& kv : state->ground_items) {
+      uint64_t h = mix(kv.first);
+      for (const auto& item : kv.second) {
+        h = mix(h ^ item.id);
+        h = mix(h ^ item.gfx_handle);
+      }
 
-            tile_stone_wall(stage, x3D, z3D, t);
-          } break;
-          case 9: tile_wood_floor(stage, x3D, z3D, t); break;
-        }
+      const auto pos = GameState::key_to_coords(kv.first);
+      ground_hashes.push_back(GroundHash{pos.first, pos.second, h});
+    }
 
-        // At the end do show items, but only nearby.
-        if (stage == 4 && j < VIEWING_DISTANCE_ITEMS) {
-          render_mobs_at(state, map_x, map_y, x3D, z3D, i == 0 && j == 0);
-          render_items_at(state, map_x, map_y, x3D, z3D, i == 0 && j == 0);
-        }
+    for (const auto& kv : state->ground_mobs) {
+      uint64_t h = mix(~kv.first);
+      for (const auto& mob : kv.second) {
+        h = mix(h ^ mob.id);
+        h = mix(h ^ mob.gfx_handle);
       }
+
+      const auto pos = GameState::key_to_coords(kv.first);
+      ground_hashes.push_back(GroundHash{pos.first, pos.second, h});
     }
+
+    ground_hashes_revision = state->ground_revision;
+    ground_hashes_valid = true;
   }
 
-  auto tm_end = clock();
+  // Anything within the view cone in any direction. The maps are unordered,
+  // so the per-position hashes are just added up.
+  const int radius = (view_distance * 3 + 3) / 2 + 1;
+  uint64_t stamp = 0;
+  for (const auto& gh : ground_hashes) {
+    if (std::abs(gh.x - x) <= radius && std::abs(gh.y - y) <= radius) {
+      stamp += gh.hash;
+    }
+  }
 
-  auto tm_diff = tm_end - tm_start;
-  float spf = float(tm_diff) / float(CLOCKS_PER_SEC);
-  float fps = 1.0f / spf;
-  (void)fps;
-  //printf("%f sec (%.1f FPS)\n", spf, fps);
+  ground_stamp_memo[ground_stamp_memo_next] =
+      GroundStampMemo{x, y, state->ground_revision, stamp, true};
+  ground_stamp_memo_next =
+      (ground_stamp_memo_next + 1) % GROUND_STAMP_MEMO_SIZE;
+  return stamp;
+}
 
-  /*
-  for (int i = 0; i < WIDTH_3D * HEIGHT_3D; i++) {
-    memcpy(&c.d[i], &r3d.itembuffer[i], 4);
-    c.d[i].a = 255;
+std::list<Engine::FrameCacheEntry>::iterator Engine::frame_cache_find(
+    const SceneKey& key) {
+  for (auto it = frame_cache.begin(); it != frame_cache.end(); ++it) {
+    if (it->key == key) {
+      return it;
+    }
   }
-  */
+
+  return frame_cache.end();
 }
 
+std::list<Engine::FrameCacheEntry>::iterator Engine::frame_cache_new_entry(
+    bool speculative) {
+  auto pos = frame_cache.begin();
+  if (speculative && !frame_cache.empty()) {
+    pos = std::next(pos);
+  }
 
-void Engine::map_at(int x, int y, int dir) {
+  // Re-use the least recently used entry (and its canvas) if full.
+  if (frame_cache.size() < FRAME_CACHE_SIZE) {
+    return frame_cache.emplace(pos);
+  }
+
+  auto last = std::prev(frame_cache.end());
+  frame_cache.splice(pos, frame_cache, last);
+  return last;  // Splicing doesn't invalidate the iterator.
+}
+
+void Engine::frame_cache_collect_picks(FrameCacheEntry *entry) {
+  entry->picks.clear();
+
+  // Projected on the side. With render bands r3d itself never renders, so
+  // its projection cache would never be flushed.
+  scene.pickable_list(&pickables);
+  for (const auto *p : pickables) {
+    r3d.build_quad_spans(p->a, p->b, &pick_spans);
+    const Render3D::QuadSpans *spans = &pick_spans;
+    if (spans->columns.empty()) {
+      continue;
+    }
+
+    // Sprites face the camera, so the whole quad has the same Z.
+    const float z = spans->columns.front().z;
+
+    int top = r3d.height;
+    int bottom = -1;
+    for (const auto& col : spans->columns) {
+      top = std::min(top, col.first_row);
+      bottom = std::max(bottom, col.last_row);
+    }
+
+    const int left = spans->columns.front().x;
+    const int w = spans->columns.back().x - left + 1;
+    const int h = bottom - top + 1;
+
+    PickQuad q{p->itemid, p->a, p->b, p->texture, z, left, top, w, h,
+               std::vector<bool>(w * h)};
+
+    // Anything nearer than the sprite (but not at the same depth, as that's
+    // most likely the sprite itself).
+    for (const auto& col : spans->columns) {
+      for (int j = col.first_row; j <= col.last_row; j++) {
+        const Render3D *r = render3d_for_row(j);
+        q.occluded[(col.x - left) + (j - top) * w] =
+            r->zbuffer[col.x + j * r3d.width] < r->depth_key(z);
+      }
+    }
+
+    entry->picks.push_back(std::move(q));
+  }
+}
+
+uint64_t Engine::item_at(int x, int y) {
+  if (frame_cache.empty()) {
+    return ITEM_NON_EXISTING_ID;
+  }
+
+  const int px = x / downscale;
+  const int py = y / downscale + r3d.offset_y;
+
+  // The nearest sprite with a visible texel there. At the same depth the one
+  // drawn first wins, same as in the Z-buffer.
+  const PickQuad *hit = nullptr;
+  for (const auto& q : frame_cache.front().picks) {
+    if (px < q.x || px >= q.x + q.w || py < q.y || py >= q.y + q.h) {
+      continue;
+    }
+
+    if (hit != nullptr && q.z >= hit->z) {
+      continue;
+    }
+
+    if (q.occluded[(px - q.x) + (py - q.y) * q.w]) {
+      continue;
+    }
+
+    if (r3d.vquad_texel(q.s, q.e, q.texture, px, py).a != 0) {
+      hit = &q;
+    }
+  }
+
+  return hit != nullptr ? hit->itemid : ITEM_NON_EXISTING_ID;
+}
 
-  // Cache this.
-  c.blit(img.get("ui_map_bg"), WIDTH_UI - 60, 0);
+void Engine::build_display_list(
+    DisplayList *dl, GameState *state, int x, int y,
+    Coords iter_external, Coords iter_internal) {
+  dl->clear();
 
-  // TODO: Don't redraw map if game state didn't change too much.
-  auto art_icons = img.get("ui_map_icons");
-  auto art_dir = img.get("ui_map_dir");
+  // Everything is traversed once, back to front. The display list takes care
+  // of putting the primitives in the correct stage and order.
+  for (int j = view_distance; j >= 0; j--) {
+    dl->next_row();
 
-  map_c.reset();
+    // Calculate the view cone.
+    const int bx = (int)(((float)j * 3.0f + 3.0f) / 2.0f);
 
-  for (int j = -4; j <= 4; j++) {
-    for (int i = -4; i <= 4; i++) {
+    for (int i = -bx; i <= bx; i++) {
+      const float x3D = (float)i * TILE_SZ;
+      const float z3D = (float)j * TILE_SZ - PLAYER_Z;
 
-      int map_x = x + i;
-      int map_y = y + j;
+      int map_x = x + iter_internal.x * i - iter_external.x * j;
+      int map_y = y + iter_internal.y * i - iter_external.y * j;
 
-      WorldMap::Tile t{2, 0};
+      WorldMap::Tile t{2 /* water */, 0};
       if (map_x >= 0 && map_x < WORLD_W &&
           map_y >= 0 && map_y < WORLD_H) {
         const size_t idx = map_x + map_y * WORLD_W;
         t = world.tiles[idx];
       }
 
-      map_c.copy(art_icons,
-             t.type * 5, 0,
-             29 + i * 5, 26 + j * 5,
-             5, 5);
+      switch (t.type) {
+        case 0: break;  // Nothing.
+        case 1: tile_grassland(dl, x3D, z3D, t); break;
+        case 2: tile_water(dl, x3D, z3D, t); break;
+        case 3: tile_mountains(dl, x3D, z3D, t); break;
+        case 4: tile_sand(dl, x3D, z3D, t); break;
+        case 5: tile_forest(dl, x3D, z3D, t); break;
+        case 6: {
+          t.variant &= 0x7f;
+          if (map_y >= 512) {
+            t.variant |= 0x80;
+          }
+          tile_rocky_road(dl, x3D, z3D, t);
+        } break;
+        case 7: tile_dirt_road(dl, x3D, z3D, t); break;
+        case 8: {
+          auto pos = GameState::coords_to_key(map_x, map_y);
+          t.variant = 0;
+          if (state->ground_items.find(pos) != state->ground_items.end()) {
+            t.variant = 0xff;
+          }
+
+          tile_stone_wall(dl, x3D, z3D, t);
+        } break;
+        case 9: tile_wood_floor(dl, x3D, z3D, t); break;
+      }
+
+      // At the end do show items, but only nearby.
+      if (j < view_distance_items) {
+        render_mobs_at(dl, state, map_x, map_y, x3D, z3D, i == 0 && j == 0);
+        render_items_at(dl, state, map_x, map_y, x3D, z3D, i == 0 && j == 0);
+      }
+    }
+  }
+}
+
+void Engine::render_view(
+    Render3D *r, const DisplayList *dl, int y, bool speculative) {
+  if (!speculative) {
+    r->projection_cache_hint_frame_change();
+  }
+
+  r->zbuffer_reset();
+  r->zbuffer_ignore = false;
+
+  // A shorter view distance gets a thicker fog, so that the world still
+  // fades out before it ends.
+  const float fog_scale = (float)VIEWING_DISTANCE / (float)view_distance;
+  if (y >= 512 && y <= 700) {
+    r->fog_setup(true, RGBA{0, 0, 0, 0}, 5.0f * fog_scale);
+  } else {
+    r->fog_setup(true, RGBA{128, 168, 255, 255}, 1.0f * fog_scale);
+  }
+
+  dl->replay(r);
+}
+
+Render3D *Engine::render3d_for_row(int y) {
+  for (const auto& band : bands) {
+    if (y >= band->band_top && y <= band->band_bottom) {
+      return band.get();
     }
   }
 
-  // Do a nice anti-aliasing border.
-  for (size_t i = 0; i < map_c.w; i++) {
-    map_c.d[i + 6 * map_c.w].a /= 8;
-    map_c.d[i + 7 * map_c.w].a /= 4;
-    map_c.d[i + 8 * map_c.w].a /= 2;
+  return &r3d;
+}
 
-    map_c.d[9 + i * map_c.w].a /= 8;
-    map_c.d[10 + i * map_c.w].a /= 4;
-    map_c.d[11 + i * map_c.w].a /= 2;
+const QualityPreset *find_quality_preset(const std::string& name) {
+  static const QualityPreset presets[] = {
+    { "high", 1, VIEWING_DISTANCE, VIEWING_DISTANCE_ITEMS },
+    { "medium", 1, 16, VIEWING_DISTANCE_ITEMS },
+    { "low", 2, 12, 3 },
+  };
 
-    map_c.d[51 + i * map_c.w].a /= 2;
-    map_c.d[52 + i * map_c.w].a /= 4;
-    map_c.d[53 + i * map_c.w].a /= 8;
+  for (const auto& preset : presets) {
+    if (name == preset.name) {
+      return &preset;
+    }
+  }
 
-    map_c.d[i + 48 * map_c.w].a /= 2;
-    map_c.d[i + 49 * map_c.w].a /= 4;
-    map_c.d[i + 50 * map_c.w].a /= 8;
+  return nullptr;
+}
+
+void Engine::set_quality(const QualityPreset *preset) {
+  assert(bands.empty());  // Bands copy the resolution when created.
+  downscale = preset->downscale;
+  view_distance = preset->view_distance;
+  view_distance_items = preset->view_distance_items;
+  r3d.set_resolution(WIDTH_3D / downscale, HEIGHT_3D / downscale);
+}
+
+void Engine::set_frame_budget(float ms) {
+  governor.budget_ms = ms;
+  governor.max_view_distance = view_distance;
+  governor.max_view_distance_items = view_distance_items;
+}
+
+void Engine::govern_view_distance(float ms) {
+  // How close the view distance may get. Below this it's mostly fog anyway.
+  const int MIN_VIEW_DISTANCE = 8;
+  const int SAMPLES_PER_DECISION = 8;
+
+  auto& g = governor;
+  g.avg_ms = g.samples == 0 ? ms : g.avg_ms * 0.75f + ms * 0.25f;
+  if (++g.samples < SAMPLES_PER_DECISION) {
+    return;
+  }
+
+  // Back off quickly, but come back slowly and only with some headroom, so
+  // that the distance doesn't keep bouncing between two values.
+  int distance = view_distance;
+  if (g.avg_ms > g.budget_ms) {
+    distance = std::max(MIN_VIEW_DISTANCE, distance - 2);
+  } else if (g.avg_ms < g.budget_ms * 0.6f) {
+    distance = std::min(g.max_view_distance, distance + 1);
+  }
+
+  if (distance == view_distance) {
+    return;
+  }
+
+  view_distance = distance;
+  view_distance_items = std::max(
+      2, g.max_view_distance_items * distance / g.max_view_distance);
+  g.samples = 0;
+
+  // The fog follows on its own (see render_view()), but the ground stamp
+  // covers a different area now.
+  for (auto& memo : ground_stamp_memo) {
+    memo.valid = false;
+  }
+  prerender_done.valid = false;
+
+  char msg[128];
+  snprintf(msg, sizeof(msg),
+           "Governor: view distance %i, items %i (%.1f ms per frame, "
+           "budget %.1f ms)",
+           view_distance, view_distance_items, g.avg_ms, g.budget_ms);
+  debug_con.puts(msg);
+}
+
+void Engine::set_render_threads(int n) {
+  assert(bands.empty());
+  render_threads = n;
+}
+
+void Engine::create_bands() {
+  const int n = render_threads;
+  if (!bands.empty() || n <= 1) {
+    return;
+  }
+
+  // Scene rows above offset_y never make it to the canvas, so only
+  // the visible part is split. The first band still gets the invisible rows
+  // so that the Z-buffer is cleared in full.
+  const int visible = r3d.height - r3d.offset_y;
+  int top = 0;
+  for (int i = 0; i < n; i++) {
+    int bottom = r3d.offset_y + visible * (i + 1) / n - 1;
+    bands.emplace_back(new Render3D(&r3d, top, bottom));
+    top = bottom + 1;
+  }
+
+  for (int i = 1; i < n; i++) {
+    band_threads.emplace_back(&Engine::band_worker, this, i);
+  }
+}
+
+void Engine::band_worker(int band) {
+  uint64_t last_frame = 0;
+
+  for (;;) {
+    BandJob job;
+    {
+      std::unique_lock<std::mutex> lock(band_mutex);
+      band_job_cv.wait(lock, [&]{
+        return band_end || band_frame != last_frame;
+      });
+
+      if (band_end) {
+        return;
+      }
+
+      last_frame = band_frame;
+      job = band_job;
+    }
+
+    render_view(bands[band].get(), job.dl, job.y, job.speculative);
+
+    {
+      std::lock_guard<std::mutex> lock(band_mutex);
+      band_pending--;
+    }
+    band_done_cv.notify_one();
+  }
+}
+
+
+void Engine::init_ui_textures() {
+  auto& ut = ui_textures;
+  ut.map_bg = img.handle("ui_map_bg");
+  ut.map_icons = img.handle("ui_map_icons");
+  ut.map_dir = img.handle("ui_map_dir");
+  ut.button_off = img.handle("ui_button_off");
+  ut.button_on = img.handle("ui_button_on");
+  ut.icon_inv_idle = img.handle("ui_icon_inv_idle");
+  ut.icon_inv_hover = img.handle("ui_icon_inv_hover");
+  ut.icon_inv_pressed = img.handle("ui_icon_inv_pressed");
+  ut.icon_magic_idle = img.handle("ui_icon_magic_idle");
+  ut.icon_magic_hover = img.handle("ui_icon_magic_hover");
+  ut.icon_magic_pressed = img.handle("ui_icon_magic_pressed");
+  ut.icon_cast_idle = img.handle("ui_icon_cast_idle");
+  ut.icon_cast_hover = img.handle("ui_icon_cast_hover");
+  ut.icon_cast_pressed = img.handle("ui_icon_cast_pressed");
+  ut.border_B = img.handle("ui_border_B");
+  ut.bar_health_bg = img.handle("ui_bar_health_bg");
+  ut.bar_health = img.handle("ui_bar_health");
+  ut.bar_mana_bg = img.handle("ui_bar_mana_bg");
+  ut.bar_mana = img.handle("ui_bar_mana");
+  ut.hud_inv = img.handle("ui_hud_inv");
+  ut.hud_spell = img.handle("ui_hud_spell");
+  ut.hand_left = img.handle("ui_hand_left");
+  ut.hand_right = img.handle("ui_hand_right");
+  ut.portrait_m = img.handle("ui_portrait_m");
+  ut.portrait_f = img.handle("ui_portrait_f");
+  ut.dir_frame = img.handle("ui_dir_frame");
+  ut.dir[0] = img.handle("ui_dir_N");
+  ut.dir[1] = img.handle("ui_dir_S");
+  ut.dir[2] = img.handle("ui_dir_W");
+  ut.dir[3] = img.handle("ui_dir_E");
+}
+
+void Engine::map_at(int x, int y, int dir) {
+  hud.blit(img.get(ui_textures.map_bg), WIDTH_UI - 60, 0);
+
+  auto art_icons = img.get(ui_textures.map_icons);
+  auto art_dir = img.get(ui_textures.map_dir);
+
+  // The map only changes when the player moves (or the world is reloaded).
+  const uint64_t revision =
+      ((uint64_t)(uint16_t)x << 48) | ((uint64_t)(uint16_t)y << 32) |
+      (uint32_t)(world.revision + 1);
+  if (revision != map_c_revision) {
+    map_c_revision = revision;
+    map_c.reset();
+
+    for (int j = -4; j <= 4; j++) {
+      for (int i = -4; i <= 4; i++) {
+
+        int map_x = x + i;
+        int map_y = y + j;
+
+        WorldMap::Tile t{2, 0};
+        if (map_x >= 0 && map_x < WORLD_W &&
+            map_y >= 0 && map_y < WORLD_H) {
+          const size_t idx = map_x + map_y * WORLD_W;
+          t = world.tiles[idx];
+        }
+
+        map_c.copy(art_icons,
+               t.type * 5, 0,
+               29 + i * 5, 26 + j * 5,
+               5, 5);
+      }
+    }
+
+    // Do a nice anti-aliasing border.
+    for (size_t i = 0; i < map_c.w; i++) {
+      map_c.d[i + 6 * map_c.w].a /= 8;
+      map_c.d[i + 7 * map_c.w].a /= 4;
+      map_c.d[i + 8 * map_c.w].a /= 2;
+
+      map_c.d[9 + i * map_c.w].a /= 8;
+      map_c.d[10 + i * map_c.w].a /= 4;
+      map_c.d[11 + i * map_c.w].a /= 2;
+
+      map_c.d[51 + i * map_c.w].a /= 2;
+      map_c.d[52 + i * map_c.w].a /= 4;
+      map_c.d[53 + i * map_c.w].a /= 8;
+
+      map_c.d[i + 48 * map_c.w].a /= 2;
+      map_c.d[i + 49 * map_c.w].a /= 4;
+      map_c.d[i + 50 * map_c.w].a /= 8;
+    }
   }
 
-  c.blit(&map_c, WIDTH_UI - 60, 0);
+  hud.blit(&map_c, WIDTH_UI - 60, 0, map_c_revision);
 
   switch (dir) {
     case NORTH:
-      c.blit(art_dir, 0 * 11, 0, WIDTH_UI - 60 + 30 - 4, 1, 11, 11);
+      hud.blit(art_dir, 0 * 11, 0, WIDTH_UI - 60 + 30 - 4, 1, 11, 11);
       break;
 
     case SOUTH:
-      c.blit(art_dir, 1 * 11, 0, WIDTH_UI - 60 + 30 - 4, 60 - 11 - 4, 11, 11);
+      hud.blit(art_dir, 1 * 11, 0, WIDTH_UI - 60 + 30 - 4, 60 - 11 - 4, 11, 11);
       break;
 
     case WEST:
-      c.blit(art_dir, 2 * 11, 0, WIDTH_UI - 60 + 4, 30 - 7, 11, 11);
+      hud.blit(art_dir, 2 * 11, 0, WIDTH_UI - 60 + 4, 30 - 7, 11, 11);
       break;
 
     case EAST:
-      c.blit(art_dir, 3 * 11, 0, WIDTH_UI - 11 - 1, 30 - 7, 11, 11);
+      hud.blit(art_dir, 3 * 11, 0, WIDTH_UI - 11 - 1, 30 - 7, 11, 11);
       break;
   }
 
 
-  c.blit(art_dir, 4 * 11, 0, WIDTH_UI - 60 + 30 - 4, 30 - 7, 11, 11);
+  hud.blit(art_dir, 4 * 11, 0, WIDTH_UI - 60 + 30 - 4, 30 - 7, 11, 11);
 }
 
-void Engine::blit_item(const std::string& name, Canvas *dst, int x, int y) {
+void Engine::blit_item(texture_handle_t h, UILayer *dst, int x, int y) {
   /* Given that we have carve out sprites and put the result in "global" texture
      namespace this code is no longer needed, but keeping it here for "just in
      case" reasons.
-  auto item = item_to_sprite_info(name);  // Always returns something.
+  const auto& item = item_to_sprite_info(name);  // Always returns something.
   auto src = img.get(item.img);
   if (item.is_sprite) {
     dst->blit(src, item.x, item.y, x, y, item.w, item.h);
   } else {
     dst->blit(src, x, y);
   }*/
-  dst->blit(img.get(name), x, y);
+  dst->blit(img.get(h), x, y);
 }
 
 void Engine::draw_ui(GameState *state) {
@@ -1760,12 +3445,12 @@ void Engine::draw_ui(GameState *state) {
     state->item_drop_dst = 255;  // Ground by default.
   }
 
-  std::string button_inv_spell("ui_button_off");
-  std::string button_inv_spell_icon(
+  texture_handle_t button_inv_spell = ui_textures.button_off;
+  texture_handle_t button_inv_spell_icon =
       (state->game_hud == GameState::HUD_SPELL) ?
-      "ui_icon_inv_idle" : "ui_icon_magic_idle");
-  std::string button_spell_cast("ui_button_off");
-  std::string button_spell_cast_icon("ui_icon_cast_idle");
+      ui_textures.icon_inv_idle : ui_textures.icon_magic_idle;
+  texture_handle_t button_spell_cast = ui_textures.button_off;
+  texture_handle_t button_spell_cast_icon = ui_textures.icon_cast_idle;
 
   // Properly this should be done using a quad tree or sth, but actually
   // there are only a couple of things too check, so...
@@ -1784,12 +3469,12 @@ void Engine::draw_ui(GameState *state) {
     }
 
     if (state->mleft) {
-      button_inv_spell = "ui_button_on";
+      button_inv_spell = ui_textures.button_on;
       button_inv_spell_icon = (state->game_hud == GameState::HUD_SPELL) ?
-          "ui_icon_inv_pressed" : "ui_icon_magic_pressed";
+          ui_textures.icon_inv_pressed : ui_textures.icon_magic_pressed;
     } else {
       button_inv_spell_icon = (state->game_hud == GameState::HUD_SPELL) ?
-          "ui_icon_inv_hover" : "ui_icon_magic_hover";
+          ui_textures.icon_inv_hover : ui_textures.icon_magic_hover;
     }
   }
 
@@ -1804,10 +3489,10 @@ void Engine::draw_ui(GameState *state) {
     }
 
     if (state->mleft) {
-      button_spell_cast = "ui_button_on";
-      button_spell_cast_icon = "ui_icon_cast_pressed";
+      button_spell_cast = ui_textures.button_on;
+      button_spell_cast_icon = ui_textures.icon_cast_pressed;
     } else {
-      button_spell_cast_icon = "ui_icon_cast_hover";
+      button_spell_cast_icon = ui_textures.icon_cast_hover;
     }
   }
 
@@ -1951,8 +3636,7 @@ void Engine::draw_ui(GameState *state) {
 
   else if (mouse_is_over(state, 0, 0, WIDTH_3D, HEIGHT_3D - SCENE_3D_OFFSET_Y)) {
     // 3D world view.
-    int idx = state->mx + (state->my + SCENE_3D_OFFSET_Y) * WIDTH_3D;
-    uint64_t itemid = r3d.itembuffer[idx];
+    uint64_t itemid = item_at(state->mx, state->my);
     if (itemid != ITEM_NON_EXISTING_ID) {
       px = state->mx;
       py = state->my;
@@ -2006,37 +3690,40 @@ void Engine::draw_ui(GameState *state) {
     }
   }
 
-  // Actual drawing starts here.
-  c.blit(img.get("ui_border_B"), 0, 0);
+  // Actual drawing starts here. It all goes to the HUD layer, which only
+  // redraws what changed since the last frame.
+  hud.begin();
+  hud.blit(img.get(ui_textures.border_B), 0, 0);
 
   int hp = std::clamp(state->player_hp, 0, state->player_hp_max);
   int mana = std::clamp(state->player_mana, 0, state->player_mana_max);
 
   int hp_px = (hp * 84) / state->player_hp_max; // 0 to 84 (inclusive)
   int mana_px = (mana * 84) / state->player_mana_max; // 0 to 84 (inclusive)
-  c.blit(img.get("ui_bar_health_bg"), 0, 0, 8, 183, 84, 10);
-  c.blit(img.get("ui_bar_health"),
-         84 - hp_px, 0, 8 + 84 - hp_px, 183, hp_px, 10);
+  hud.blit(img.get(ui_textures.bar_health_bg), 0, 0, 8, 183, 84, 10);
+  hud.blit(img.get(ui_textures.bar_health),
+           84 - hp_px, 0, 8 + 84 - hp_px, 183, hp_px, 10);
 
-  c.blit(img.get("ui_bar_mana_bg"), 0, 0, 336, 183, 84, 10);  // 84 max
-  c.blit(img.get("ui_bar_mana"), 0, 0, 336, 183, mana_px, 10);  // 84 max
+  hud.blit(img.get(ui_textures.bar_mana_bg), 0, 0, 336, 183, 84, 10);  // 84 max
+  hud.blit(img.get(ui_textures.bar_mana), 0, 0, 336, 183, mana_px, 10);  // 84 max
 
   //state->game_hud = GameState::HUD_SPELL;
   if (state->game_hud == GameState::HUD_INVENTORY) {
-    auto hud = img.get("ui_hud_inv");
-    c.blit(hud, 0, 240 - hud->h);  // TODO agressive cut hud.
-    c.blit(img.get("ui_hand_left"), 96, 208);
-    c.blit(img.get("ui_hand_right"), 128, 208);
+    auto hud_inv = img.get(ui_textures.hud_inv);
+    hud.blit(hud_inv, 0, 240 - hud_inv->h);  // TODO agressive cut hud.
+    hud.blit(img.get(ui_textures.hand_left), 96, 208);
+    hud.blit(img.get(ui_textures.hand_right), 128, 208);
 
-    c.blit(img.get(state->player_gender ? "ui_portrait_m" : "ui_portrait_f"),
-           48, 204);
+    hud.blit(img.get(state->player_gender ?
+                             ui_textures.portrait_m : ui_textures.portrait_f),
+             48, 204);
 
     if (state->equiped[HAND_LEFT].id != ITEM_NON_EXISTING_ID) {
-      blit_item(state->equiped[HAND_LEFT].gfx_id, &c, 96 + 4, 208 + 4);
+      blit_item(state->equiped[HAND_LEFT].gfx_handle, &hud, 96 + 4, 208 + 4);
     }
 
     if (state->equiped[HAND_RIGHT].id != ITEM_NON_EXISTING_ID) {
-      blit_item(state->equiped[HAND_RIGHT].gfx_id, &c, 128 + 4, 208 + 4);
+      blit_item(state->equiped[HAND_RIGHT].gfx_handle, &hud, 128 + 4, 208 + 4);
     }
 
     for (int i = 0; i < 8; i++) {
@@ -2044,53 +3731,50 @@ void Engine::draw_ui(GameState *state) {
         continue;
       }
 
-      blit_item(state->inventory[i].gfx_id, &c, 172 + 32 * i, 208 + 4);
+      blit_item(state->inventory[i].gfx_handle, &hud, 172 + 32 * i, 208 + 4);
     }
 
-    c.blit(img.get(button_inv_spell), 12, 208);
-    c.blit(img.get(button_inv_spell_icon), 12, 208);
+    hud.blit(img.get(button_inv_spell), 12, 208);
+    hud.blit(img.get(button_inv_spell_icon), 12, 208);
 
   } else if (state->game_hud == GameState::HUD_SPELL) {
-    auto hud = img.get("ui_hud_spell");
-    c.blit(hud, 0, 240 - hud->h);  // TODO agressive cut hud.
+    auto hud_spell = img.get(ui_textures.hud_spell);
+    hud.blit(hud_spell, 0, 240 - hud_spell->h);  // TODO agressive cut hud.
 
     for (int i = 0; i < state->spell_length; i++) {
       uint8_t buf[3] = { 0xff, state->spell[i], 0 };
-      txt->render(&c, 151 + 16 * i, 187, 15, 15, (char*)buf);
+      txt->render(&hud, 151 + 16 * i, 187, 15, 15, (char*)buf);
     }
 
     // This is somewhat funny, but probably it's the simplest way to do it.
-    txt->render(&c, (428 - 192) / 2 - 1, 204 - 2, 192 + 2 + 12, 10,
+    txt->render(&hud, (428 - 192) / 2 - 1, 204 - 2, 192 + 2 + 12, 10,
         "\xff\x40\xff\x41\xff\x42\xff\x43\xff\x44\xff\x45\xff\x46\xff\x47"
         "\xff\x48\xff\x49\xff\x4a\xff\x4b\xff\x4c\xff\x4d\xff\x4e\xff\x4f");
 
-    txt->render(&c, (428 - 192) / 2 - 1, 204 - 2 + 9, 192 + 2 + 12, 10,
+    txt->render(&hud, (428 - 192) / 2 - 1, 204 - 2 + 9, 192 + 2 + 12, 10,
         "\xff\x50\xff\x51\xff\x52\xff\x53\xff\x54\xff\x55\xff\x56\xff\x57"
         "\xff\x58\xff\x59\xff\x5a\xff\x5b\xff\x5c\xff\x5d\xff\x5e\xff\x5f");
 
-    txt->render(&c, (428 - 192) / 2 - 1, 204 - 2 + 18, 192 + 2 + 12, 10,
+    txt->render(&hud, (428 - 192) / 2 - 1, 204 - 2 + 18, 192 + 2 + 12, 10,
         "\xff\x60\xff\x61\xff\x62\xff\x63\xff\x64\xff\x65\xff\x66\xff\x67"
         "\xff\x68\xff\x69\xff\x6a\xff\x6b\xff\x6c\xff\x6d\xff\x6e\xff\x6f");
 
-    txt->render(&c, (428 - 192) / 2 - 1, 204 - 2 + 27, 192 + 2 + 12, 10,
+    txt->render(&hud, (428 - 192) / 2 - 1, 204 - 2 + 27, 192 + 2 + 12, 10,
         "\xff\x70\xff\x71\xff\x72\xff\x73\xff\x74\xff\x75\xff\x76\xff\x77"
         "\xff\x78\xff\x79\xff\x7a\xff\x7b\xff\x7c\xff\x7d\xff\x7e\xff\x7f");
 
-    c.blit(img.get(button_inv_spell), 12, 208);
-    c.blit(img.get(button_inv_spell_icon), 12, 208);
-    c.blit(img.get(button_spell_cast), 392, 208);
-    c.blit(img.get(button_spell_cast_icon), 392, 208);
+    hud.blit(img.get(button_inv_spell), 12, 208);
+    hud.blit(img.get(button_inv_spell_icon), 12, 208);
+    hud.blit(img.get(button_spell_cast), 392, 208);
+    hud.blit(img.get(button_spell_cast_icon), 392, 208);
   }
 
-  in_game_text.render_to(&c, 10, 10);
-  c.blit(img.get("ui_dir_frame"), 172, 0);
+  in_game_text.render_to(&hud, 10, 10);
+  hud.blit(img.get(ui_textures.dir_frame), 172, 0);
 
-  auto dir = img.get(
-      state->player_dir == NORTH ? "ui_dir_N" :
-      state->player_dir == SOUTH ? "ui_dir_S" :
-      state->player_dir == WEST  ? "ui_dir_W" :
-                                   "ui_dir_E");
-  c.blit(dir, (428 - 32) / 2, 4);
+  const int dir = (state->player_dir >= NORTH && state->player_dir <= WEST) ?
+                  state->player_dir : EAST;
+  hud.blit(img.get(ui_textures.dir[dir]), (428 - 32) / 2, 4);
 
   map_at(state->player_x, state->player_y, state->player_dir);
 
@@ -2117,9 +3801,10 @@ void Engine::draw_ui(GameState *state) {
 
     tooltip = "\x13" + tooltip;
 
-    txt->render(&c, x, y, w, 10, tooltip);
+    txt->render(&hud, x, y, w, 10, tooltip);
   }
 
+  hud.end();
 }
 
 bool Engine::mouse_is_over(GameState *state, int x, int y, int w, int h) {
@@ -2142,10 +3827,12 @@ void Engine::render_frame(GameState *state) {
 
   if (state->game_scene == GameState::SCENE_GAME) {
     // Render the 3D scene first.
-    render_at(state, state->player_x, state->player_y, state->player_dir);
+    const Canvas *view = render_at(
+        state, state->player_x, state->player_y, state->player_dir);
 
-    // Render the UI on top of the 3D scene.
+    // Update the UI layer and put it on top of the 3D scene.
     draw_ui(state);
+    hud.composite(view != nullptr ? view : &c, &c);
   }
 
   // Render the console on top of it all if needed.
@@ -1,14 +1,19 @@
 #pragma once
 #include <algorithm>
 #include <stdint.h>
+#include <cstring>
 #include <vector>
 #include <string>
 #include <utility>
 #include <SDL2/SDL_image.h>
 #include <unordered_map>
 #include <memory>
+#include <list>
 #include <limits>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 #include "world_map.h"
 #include "gamestate.h"
@@ -72,7 +77,7 @@ class Canvas {
 
   // From scratch.
   Canvas(unsigned int width, unsigned int height)
-      : w{width}, h{height}, d{w * h}, texel_cache{w * h} {}
+      : w{width}, h{height}, d{w * h} {}
 
   // From SDL surface.
   Canvas(SDL_Surface *s);
@@ -92,6 +97,9 @@ class Canvas {
             int dst_x, int dst_y,
             int src_w, int src_h);
 
+  // Nearest neighbour, as much as fits.
+  void scale_up(const Canvas *src, int factor);
+
   void blit(Canvas *src,
             int src_x, int src_y,
             int dst_x, int dst_y,
@@ -102,17 +110,157 @@ class Canvas {
   void reset();
 
   // For textures.
-  RGBA get_texel(Coordsf p, Coordsf sz);  // Pixel coords and size.
-  std::vector<std::unordered_map<uint32_t, RGBA>> texel_cache;  // Mipmap cheat.
+  RGBA get_texel(Coordsf p, Coordsf sz) const;  // Pixel coords and size.
+  inline RGBA get_texel(Coordsf p) const {  // Nearest texel of this level.
+    const int x = (int)(std::clamp(p.x, 0.0f, 1.0f) * (float)(w - 1));
+    const int y = (int)(std::clamp(p.y, 0.0f, 1.0f) * (float)(h - 1));
+    return d[x + y * w];
+  }
+
+  // Builds the whole mip chain down to 1x1. Each level is a box-filtered
+  // (2x2) version of the previous one, where only fully opaque texels are
+  // averaged (a texel with no opaque sources becomes fully transparent).
+  void generate_mipmaps();
+  const Canvas *mipmap_level(Coordsf sz) const;  // Picked by texel size.
+  std::vector<Canvas> mipmaps;  // Level 1 onward (level 0 is this canvas).
+  bool opaque = false;  // All texels have alpha 255 (set with the mipmaps).
+
+  // A copy of the texels stored in 4x4 blocks (64 bytes, i.e. a cache line
+  // each). vquad samples textures down the columns, which in the linear
+  // layout means a new cache line for every texel. Built for every mip
+  // level along with the mipmaps, so render targets don't have it.
+  static const unsigned int BLOCK_SHIFT = 2;
+  static const unsigned int BLOCK_MASK = (1 << BLOCK_SHIFT) - 1;
+  std::vector<RGBA> blocked;
+  unsigned int blocked_stride = 0;  // Texels in a row of blocks.
+
+  void generate_blocked();
+  inline size_t blocked_index(unsigned int x, unsigned int y) const {
+    return (y >> BLOCK_SHIFT) * blocked_stride +
+           ((x >> BLOCK_SHIFT) << (2 * BLOCK_SHIFT)) +
+           ((y & BLOCK_MASK) << BLOCK_SHIFT) + (x & BLOCK_MASK);
+  }
+
+  // Runs of non-transparent texels (fully transparent ones are left out), so
+  // that sprites can skip the empty parts without looking at them. Built
+  // with the mipmaps for images with alpha only: row runs for the image
+  // itself (blit), column runs for every mip level (vquad).
+  struct AlphaRun {
+    uint16_t start;
+    uint16_t length;
+    bool opaque;  // All texels of the run have alpha 255.
+  };
+
+  std::vector<AlphaRun> row_runs;
+  std::vector<uint32_t> row_runs_index;  // Row y is [index[y], index[y + 1]).
+  std::vector<AlphaRun> column_runs;
+  std::vector<uint32_t> column_runs_index;
+
+  void generate_runs(bool rows);
 
   // For debugging.
   void dump(const std::string& fname);  // Will write PNG
 };
 
+// A retained layer for the HUD. Widgets (sub-rects of canvases) are added
+// every frame in drawing order, but only the parts of the layer where they
+// changed since the last frame are actually redrawn. The layer is then
+// blended over the 3D view in one pass.
+class UILayer {
+ public:
+  UILayer(unsigned int width, unsigned int height)
+      : w{width}, h{height}, d{w * h, Pixel{0, 0, 0, 256, 0}} {}
+
+  void begin();
+
+  // Same as Canvas::blit. Revision has to change whenever the pixels of src
+  // change (images never do, so it's 0 for them).
+  void blit(const Canvas *src,
+            int src_x, int src_y,
+            int dst_x, int dst_y,
+            int src_w, int src_h,
+            uint64_t revision = 0);
+
+  void blit(const Canvas *src, int dst_x, int dst_y, uint64_t revision = 0);
+
+  void end();
+
+  // dst = this layer over the under canvas (both have the layer's size, and
+  // might be the same canvas).
+  void composite(const Canvas *under, Canvas *dst) const;
+
+ private:
+  struct Widget {
+    const Canvas *src;
+    int src_x, src_y;
+    int dst_x, dst_y;
+    int w, h;
+    uint64_t revision;
+
+    bool operator==(const Widget& o) const {
+      return src == o.src && src_x == o.src_x && src_y == o.src_y &&
+             dst_x == o.dst_x && dst_y == o.dst_y && w == o.w && h == o.h &&
+             revision == o.revision;
+    }
+  };
+
+  struct Rect {
+    int x0, y0, x1, y1;  // Right/bottom edges are exclusive.
+  };
+
+  // A layer pixel is applied as (rgb + under * k) >> 8. For a single widget
+  // this is exactly what Canvas::blit does (k is 256 for transparent pixels
+  // and 0 for opaque ones). Stacked semi-transparent widgets are folded into
+  // one, which might be off by one compared to blitting them one by one.
+  struct Pixel {
+    uint16_t r, g, b, k;
+    uint8_t a;  // Max alpha of the widgets (same as in Canvas::blit).
+  };
+
+  void add_dirty(const Widget& widget);
+  void redraw(const Rect& rect);
+  void generate_runs();
+
+  unsigned int w, h;
+  std::vector<Pixel> d;
+
+  // Same as in Canvas, so that composite() can skip the transparent parts
+  // and copy the opaque ones (from opaque_colors).
+  std::vector<Canvas::AlphaRun> runs;
+  std::vector<uint32_t> runs_index;
+  std::vector<RGBA> opaque_colors;
+
+  std::vector<Widget> widgets;  // This frame.
+  std::vector<Widget> previous;  // Last frame.
+  std::vector<Rect> dirty;
+};
+
+// Recycles canvases of similar sizes (the size classes are powers of two of
+// the pixel count), so that caches which keep replacing their canvases don't
+// go to the heap each time.
+class CanvasPool {
+ public:
+  // The canvas is cleared to transparent black.
+  std::unique_ptr<Canvas> get(unsigned int w, unsigned int h);
+  void put(std::unique_ptr<Canvas> c);
+
+ private:
+  static const int CLASSES = 32;
+  static const size_t MAX_FREE_PER_CLASS = 8;
+
+  static int size_class(size_t pixels) {
+    return pixels <= 1 ? 0 : 64 - __builtin_clzll(pixels - 1);
+  }
+
+  std::vector<std::unique_ptr<Canvas>> free_canvases[CLASSES];
+};
+
 class TextRenderer {
  public:
   TextRenderer(Canvas *font, Canvas *rune_bg, Canvas *runes)
-      : font_(font), rune_bg_(rune_bg), runes_(runes) { }
+      : font_(font), rune_bg_(rune_bg), runes_(runes) {
+    build_atlas();
+  }
 
   void hint_frame_change();
 
@@ -121,34 +269,91 @@ class TextRenderer {
   // still the number of lines rendered though).
   int printf(Canvas *dst, int x, int y, int w, int h, const char *fmt, ...);
   int render(Canvas *dst, int x, int y, int w, int h, const std::string& text);
+  int render(UILayer *dst, int x, int y, int w, int h, const std::string& text);
+
+  // Renders straight into the top left w x h of dst, which has to be clear
+  // there. The cache is not involved, so it's meant for texts which are
+  // rendered only once anyway.
+  int render_uncached(Canvas *dst, int w, int h, const std::string& text);
+
+  // Rendered texts are cached (LRU) up to this many bytes of canvases. Texts
+  // used in the current frame are never evicted though.
+  static const size_t CACHE_BUDGET = 4 << 20;
+
+  struct CacheStats {
+    uint64_t hits, misses, evictions;
+    size_t entries, bytes;
+  };
+
+  const CacheStats& cache_stats() const { return stats; }
 
  private:
   struct CachedText {
+    uint64_t key;
+    std::string text;  // In case of a hash collision.
+    int w, h;
     int lines_rendered;  // Can be negative.
-    Canvas *text;
+    std::unique_ptr<Canvas> canvas;
+    uint64_t frame;  // Last used in.
   };
 
-  Canvas *render_worker(const std::string& text, int w, int h, int *lines_rendered);
+  Canvas *render_worker(const std::string& text, int w, int h, uint64_t key,
+                        int *lines_rendered);
+  int rasterize(Canvas *dst, int w, int h, const std::string& text);
+
+  // These are used only to build the atlas.
   void render_char(Canvas *dst, int x, int y, unsigned char ch, RGBA color);
   void render_rune(Canvas *dst, int x, int y, unsigned char rune);
   void render_outline(Canvas *dst, int x, int y, int w, int h, RGBA outline);
 
-  std::string cache_key(const std::string& text, int w, int h);
-  CachedText *cache_get(const std::string& key);
-  void cache_store(const std::string& key, CachedText *rendered_text);
-  // Note: Cache takes ownership of the rendered_text Canvas.
+  // The atlas holds every printable character in each of the 16 colors, and
+  // every rune, already outlined. Each one sits in its own tile, which is the
+  // glyph plus a 1 pixel border. Texts are then put together from tiles.
+  static const int ATLAS_COLORS = 16;
+  static const int ATLAS_CHARS = 0x7e - 0x20;  // Font has no ~ (see below).
+  static const int ATLAS_RUNES = 0x40;
+  static const int CHAR_TILE_W = FONT_W + 2;
+  static const int RUNE_TILE_W = FONT_W * 2 + 2;
+  static const int TILE_H = FONT_H + 2;
+
+  // Tile pixels are either solid (a >= 200) or outline, and the outline is
+  // never drawn over solid pixels of other glyphs.
+  struct GlyphRun {
+    uint8_t x, y, length;
+    bool solid;
+  };
+
+  void build_atlas();
+  void blit_tile(Canvas *dst, int x, int y, int tile);  // x/y of the glyph.
+
+  static int char_tile(int color, unsigned char ch) {
+    return color * ATLAS_CHARS + (ch - 0x20);
+  }
+
+  static int rune_tile(unsigned char rune) {
+    return ATLAS_COLORS * ATLAS_CHARS + (rune - 0x40);
+  }
+
+  std::unique_ptr<Canvas> atlas;
+  std::vector<uint32_t> atlas_tiles;  // Offset of the tile's top left pixel.
+  std::vector<GlyphRun> atlas_runs;
+  std::vector<uint32_t> atlas_runs_index;  // Runs of tile i are [i, i + 1).
+
+  static uint64_t cache_key(const std::string& text, int w, int h);
+  void cache_remove(std::list<CachedText>::iterator entry);
+  void cache_trim();  // Down to the budget.
 
   // TextRenderer is NOT the owner of these canvases.
   Canvas *font_ = nullptr;
   Canvas *rune_bg_ = nullptr;
   Canvas *runes_ = nullptr;
 
-  // TextRenderer is the owner of the cached rendered canvases.
-  // Note: the key is a concatenation of uint16_t width and height of the text
-  // field, and the actual text.
-  std::unordered_map<std::string, CachedText*> cache[2];
-  int cache_current = 0;
-
+  // Most recently used first.
+  std::list<CachedText> lru;
+  std::unordered_map<uint64_t, std::list<CachedText>::iterator> cache;
+  uint64_t frame = 0;
+  CacheStats stats{};
+  CanvasPool pool;
 };
 
 class ImageManager {
@@ -159,20 +364,48 @@ class ImageManager {
   void add(const std::string& id,
            Canvas *c);  // ImageManager takes ownership of *c.
 
-  Canvas* get(std::string id);
+  // Ids are interned into integer handles, so that the hot paths don't have
+  // to pass strings around and hash them. A handle can be requested before
+  // the image is loaded, and it never changes afterwards.
+  // Note: this is not thread-safe (unlike both get() functions).
+  texture_handle_t handle(const std::string& id);
+  const std::string& id(texture_handle_t h) const { return ids[h]; }
+
+  Canvas* get(const std::string& id);
+  inline Canvas* get(texture_handle_t h) const {
+    return h < images.size() ? images[h].get() : nullptr;
+  }
 
  private:
-  std::unordered_map<std::string, std::unique_ptr<Canvas>> images;
+  std::unordered_map<std::string, texture_handle_t> handles;
+  std::vector<std::unique_ptr<Canvas>> images;  // Indexed by handles.
+  std::vector<std::string> ids;
 };
 
 class Render3D {
  public:
   Render3D(Canvas *canvas, ImageManager *images)
-      : c{canvas}, img{images}, fog_enable(false) {
-        zbuffer.resize(c->w * c->h);
+      : c{canvas},
+        zbuffer{zbuffer_storage},
+        img{images}, fog_enable(false) {
+        zbuffer.resize(c->w * c->h, DEPTH_STALE);
         zbuffer_reset();
-        itembuffer.resize(c->w * c->h);
-        itembuffer_reset();
+      }
+
+  // A horizontal band of another renderer. It shares the canvas, images and
+  // the Z-buffer with the parent, but never touches anything outside of
+  // rows [top, bottom]. This way bands can be rendered in parallel. The
+  // settings are copied, so the parent has to be fully set up first.
+  Render3D(Render3D *parent, int top, int bottom)
+      : c{parent->c},
+        zbuffer{parent->zbuffer},
+        img{parent->img}, fog_enable(false),
+        band_top{top}, band_bottom{bottom},
+        width{parent->width}, height{parent->height},
+        width_f{parent->width_f}, height_f{parent->height_f},
+        scale_3d{parent->scale_3d}, offset_y{parent->offset_y} {
+        projection_cache_enable = parent->projection_cache_enable;
+        depth_epoch = parent->depth_epoch;
       }
 
   Coords point3D_to_2D(Coords3D p);
@@ -192,10 +425,69 @@ class Render3D {
 
   // "s" is supposed to be bottom left corner of the quad, and "e" is
   // the top right corner (a little weird, but it makes most sense to me.
-  void vquad(Coords3D s, Coords3D e, std::string texture_id);
+  void vquad(Coords3D s, Coords3D e, const std::string& texture_id);
+  void vquad(Coords3D s, Coords3D e, const Canvas *texture);
+
+  // The texel vquad() would draw at the given pixel (alpha 0 if the quad
+  // doesn't cover it), regardless of the Z-buffer. Used for picking, so it
+  // doesn't go through the projection cache.
+  RGBA vquad_texel(Coords3D s, Coords3D e, const Canvas *texture,
+                   int x, int y);
 
   // "m" is middle of the tile, and sz is it's size (y coord is ignored).
-  void tile(Coords3D m, Coords3D sz, std::string texture_id);
+  void tile(Coords3D m, Coords3D sz, const std::string& texture_id);
+  void tile(Coords3D m, Coords3D sz, const Canvas *texture);
+
+  // Both of the above are done in two steps. First the screen-space spans
+  // are calculated (this depends only on the geometry), and then the texture
+  // is gathered along them.
+
+  // One visible column of a vquad.
+  struct QuadColumn {
+    int x;
+    int top;  // Unclamped top edge (texture row 0).
+    int first_row, last_row;  // The visible part of the column.
+    int vert_diff;  // Unclamped height of the column (at least 1).
+    float z;
+    float u;  // Texture X coordinate (0.0 - 1.0).
+  };
+
+  struct QuadSpans {
+    float texel_sz_hor;
+    std::vector<QuadColumn> columns;
+  };
+
+  // One visible scanline of a tile.
+  struct TileRow {
+    int y;
+    int start_x;  // Unclamped left edge (texture column 0).
+    int span_w;  // Unclamped width of the scanline.
+    int first_i, last_i;  // The visible part of the scanline.
+    float z;
+    float v;  // Texture Y coordinate (0.0 - 1.0).
+    float texel_sz_z;
+  };
+
+  struct TileSpans {
+    std::vector<TileRow> rows;
+  };
+
+  void build_quad_spans(Coords3D s, Coords3D e, QuadSpans *out);
+  void build_tile_spans(Coords3D m, Coords3D sz, TileSpans *out);
+
+  // Return the spans for the given geometry. The returned object is valid
+  // until the next call.
+  const QuadSpans *quad_spans(Coords3D s, Coords3D e);
+  const TileSpans *tile_spans(Coords3D m, Coords3D sz);
+
+  // Projection cache (for a grid-locked camera). The camera in this engine is
+  // always at (0, EYE_LEVEL, 0), so if the caller always places the geometry
+  // at the same relative positions (e.g. the engine only moves tile by tile
+  // and turns by 90 degrees), the spans repeat every frame and can be
+  // memoized by their geometry. Entries not used in the last frame are
+  // dropped at frame change.
+  bool projection_cache_enable{false};
+  void projection_cache_hint_frame_change();
 
   // Place a pixel with alpha, z-buffer.
   inline RGBA merge_colors(RGBA a, RGBA b) {
@@ -212,36 +504,42 @@ class Render3D {
   }
 
   inline void pixel3D(Coords p, float z, RGBA color) {
-    if (p.x < 0 || p.y < 0 || p.x >= (int)c->w || p.y >= (int)c->h) {
+    if (p.x < 0 || p.y < band_top || p.x >= (int)c->w || p.y > band_bottom) {
       return;
     }
 
-    const size_t idx = p.x + p.y * c->w;
+    pixel3D_unchecked(p.x + p.y * c->w, p.y, z, depth_key(z), color);
+  }
 
+  // Same as pixel3D, but the caller guarantees that idx (which is x + y * w)
+  // is within the canvas and the band, and passes depth_key(z) as well.
+  inline void pixel3D_unchecked(
+      size_t idx, int y, float z, uint32_t depth, RGBA color) {
     if (color.a == 0) {
       return;  // Would not be visible anyway.
     }
 
-    if (!zbuffer_ignore && z >= zbuffer[idx]) {
+    if (!zbuffer_ignore && depth >= zbuffer[idx]) {
       return;
     }
 
-    zbuffer[idx] = z;
-    if (itembuffer_enable) {
-      itembuffer[idx] = itemid;
-    }
-
-    RGBA final = color.a == 255 ? color : merge_colors(color, c->d[idx]);
-    if (this->fog_enable) {
-      final = merge_colors(fog_get_color(z), final);
-    }
+    zbuffer[idx] = depth;
 
     // Y offset.
-    const int offset_y = p.y - SCENE_3D_OFFSET_Y;
-    if (offset_y < 0) {
+    if (y < offset_y) {
       return;
     }
-    const size_t offset_idx = p.x + offset_y * c->w;
+    const size_t offset_idx = idx - offset_y * c->w;
+
+    RGBA final = color.a == 255 ? color : merge_colors(color, c->d[offset_idx]);
+    if (this->fog_enable) {
+      // Same as merge_colors(fog_get_color(z), final), but with the fog part
+      // taken from the table.
+      const FogEntry& fog = fog_entry(z);
+      final.r = (uint8_t)((fog.r + (uint32_t)final.r * fog.k) >> 8);
+      final.g = (uint8_t)((fog.g + (uint32_t)final.g * fog.k) >> 8);
+      final.b = (uint8_t)((fog.b + (uint32_t)final.b * fog.k) >> 8);
+    }
 
     c->d[offset_idx] = RGBA{
         mask_pixel(final.r),
@@ -255,60 +553,259 @@ class Render3D {
   void helper_3D_block(float x, float z);
   void helper_3D_floor(float x, float z);
 
+  // Values used by tile() for each scanline of a floor/ceiling at height y.
+  struct Scanline {
+    float z;  // Z of the floor/ceiling seen at this scanline.
+    float z_delta;  // Z distance to the previous scanline (texel footprint).
+    float x_scale;  // Screen pixels per 1m in X at this z.
+  };
+
+  struct ScanlineTable {
+    float y;
+    std::vector<Scanline> lines;  // One for each scanline of the canvas.
+  };
+
+  // Returns the table for a given height (built on first use).
+  const ScanlineTable *scanline_table(float y);
+
   // Fog functions.
   void fog_setup(bool enable, RGBA color, float intensity);
   RGBA fog_get_color(float z);
 
-  // Helper routines for Z-buffer.
+  // fog_get_color() precomputed for quantized z, in a form ready to be
+  // blended in fixed point. The table is rebuilt by fog_setup() whenever the
+  // fog parameters change.
+  struct FogEntry {
+    uint16_t r, g, b;  // Fog color multiplied by fog alpha.
+    uint16_t k;  // 255 - fog alpha.
+  };
+
+  static const int FOG_TABLE_SIZE = 4096;
+
+  inline const FogEntry& fog_entry(float z) const {
+    const float i = std::clamp(
+        (z - fog_table_start) * fog_table_scale,
+        0.0f, (float)(FOG_TABLE_SIZE - 1));
+    return fog_table[(int)i];
+  }
+
+  // The Z-buffer holds 24-bit fixed point z, with the top 8 bits being the
+  // (inverted) frame epoch. This way entries from previous frames always
+  // compare as further away than anything drawn in the current frame, so
+  // resetting the buffer is just bumping the epoch. A real clear is needed
+  // only once every 256 frames.
+  static constexpr float DEPTH_SCALE = 4096.0f;  // Z units per 1m.
+  static constexpr uint32_t DEPTH_STALE = 0xffffffff;
+
+  inline uint32_t depth_key(float z) const {
+    const float d = std::clamp(z * DEPTH_SCALE, 0.0f, (float)0xffffff);
+    return ((uint32_t)(255 - depth_epoch) << 24) | (uint32_t)d;
+  }
+
+  // Helper routines for Z-buffer (these reset only the band).
   inline void zbuffer_reset() {
-    std::fill(this->zbuffer.begin(), this->zbuffer.end(),
-              std::numeric_limits<float>::infinity());
+    if (++depth_epoch == 256) {
+      std::fill(this->zbuffer.begin() + band_top * c->w,
+                this->zbuffer.begin() + (band_bottom + 1) * c->w,
+                DEPTH_STALE);
+      depth_epoch = 0;
+    }
   }
 
   Canvas *c;  // Render3D is not the owner of this object.
-              // The canvas MUST be WIDTH_3D x HEIGHT_3D size.
-  std::vector<float> zbuffer;  // Z-buffer used here and there.
-  bool zbuffer_ignore;  // If true, the Z-buffer will be filled, but ignored
-                        // while drawing (useful for transparency).
+              // The canvas MUST be width x height size.
 
-  std::vector<uint64_t> itembuffer;  // Item IDs per pixel.
-  inline void itembuffer_reset() {
-    std::fill(this->itembuffer.begin(), this->itembuffer.end(),
-              ITEM_NON_EXISTING_ID);
-  }
+ private:
+  // Bands use their parent's buffers (see the constructors).
+  std::vector<uint32_t> zbuffer_storage;
 
-  bool itembuffer_enable{false};  // If true, pixel3D paints with itemid.
-  uint64_t itemid;  // Item "color".
+ public:
+  std::vector<uint32_t>& zbuffer;  // Z-buffer used here and there.
+  bool zbuffer_ignore;  // If true, the Z-buffer will be filled, but ignored
+                        // while drawing (useful for transparency).
+  int depth_epoch = 0;
 
   ImageManager *img;
 
+  std::vector<std::unique_ptr<ScanlineTable>> scanline_tables;
+
   bool fog_enable;
   RGBA fog_color;
   float fog_intensity;
+
+  std::vector<FogEntry> fog_table;
+  float fog_table_start;  // Z of the first entry.
+  float fog_table_scale;  // Entries per 1m.
+
+  // Rows of the canvas this renderer is allowed to touch.
+  int band_top = 0;
+  int band_bottom = HEIGHT_3D - 1;
+
+  // Size of the 3D view and everything derived from it. Lower resolutions
+  // keep the same field of view, they just have bigger pixels.
+  int width = WIDTH_3D;
+  int height = HEIGHT_3D;
+  float width_f = WIDTH_3DF;
+  float height_f = HEIGHT_3DF;
+  float scale_3d = SCALE_3D;
+  int offset_y = SCENE_3D_OFFSET_Y;  // First scene row shown on the canvas.
+
+  // Must be called before the first frame (and before creating bands). The
+  // size can't be bigger than WIDTH_3D x HEIGHT_3D, and the canvas has to
+  // match it.
+  void set_resolution(int w, int h);
+
+  // Coverage buffer for geometry drawn front to back. For each column it
+  // keeps a range of rows that was already painted by opaque quads, which
+  // vquad then skips altogether. Stuff added to the buffer is only taken into
+  // account after coverage_commit(), i.e. once the caller knows that
+  // everything drawn next is further away.
+  bool coverage_enable{false};
+  void coverage_reset();
+  void coverage_commit();
+  inline bool coverage_full() const {  // Nothing more can be visible.
+    return coverage_full_columns == width;
+  }
+
+ private:
+  struct CoverageSpan {
+    int top, bottom;  // Empty if top > bottom.
+  };
+
+  void coverage_add(int x, int top, int bottom);
+
+  CoverageSpan coverage[WIDTH_3D];
+  CoverageSpan coverage_pending[WIDTH_3D];
+  int coverage_full_columns = 0;
+
+  struct ProjectionKey {
+    float v[6];  // Two points (s and e for vquad, m and sz for tile).
+    bool operator==(const ProjectionKey& other) const {
+      return memcmp(v, other.v, sizeof(v)) == 0;
+    }
+  };
+
+  struct ProjectionKeyHash {
+    size_t operator()(const ProjectionKey& key) const;
+  };
+
+  template<typename T>
+  const T *projection_cache_get(
+      std::unordered_map<ProjectionKey, std::unique_ptr<T>,
+                         ProjectionKeyHash> *cache,
+      const ProjectionKey& key, T *scratch,
+      void (Render3D::*build)(Coords3D, Coords3D, T*));
+
+  std::unordered_map<ProjectionKey, std::unique_ptr<QuadSpans>,
+                     ProjectionKeyHash> quad_cache[2];
+  std::unordered_map<ProjectionKey, std::unique_ptr<TileSpans>,
+                     ProjectionKeyHash> tile_cache[2];
+  int projection_cache_current = 0;
+
+  // Used when the projection cache is disabled.
+  QuadSpans quad_scratch;
+  TileSpans tile_scratch;
+};
+
+// A recorded 3D scene, i.e. all the primitives the view cone traversal
+// emitted, already bucketed by the stage they are drawn in. Replaying it
+// gives exactly the same result as traversing the map again.
+class DisplayList {
+ public:
+  static const int STAGES = 5;
+
+  struct Primitive {
+    enum primitive_type_t : uint8_t {
+      QUAD,
+      TILE
+    } type;
+    bool pickable;
+    uint64_t itemid;
+    Coords3D a, b;  // Same as the arguments of Render3D::vquad/tile.
+    const Canvas *texture;
+  };
+
+  DisplayList(ImageManager *images) : img{images} {}
+
+  void clear();
+
+  // Stages 0-3 are drawn back to front with the Z-buffer ignored, and stage 4
+  // is drawn front to back. The traversal always goes back to front, so it
+  // needs to mark where each row of the view cone starts for stage 4 to be
+  // replayed in reverse.
+  void next_row();
+
+  void vquad(int stage, Coords3D s, Coords3D e, texture_handle_t texture);
+  void tile(int stage, Coords3D m, Coords3D sz, texture_handle_t texture);
+
+  // Item and mob billboards. They go to stage 4 in the traversal order,
+  // interleaved with the geometry around them, so that their semi-transparent
+  // edges blend with the same things as when they were drawn directly.
+  void sprite(Coords3D s, Coords3D e, texture_handle_t texture);
+
+  // The pickable primitives, in the order replay() draws them.
+  void pickable_list(std::vector<const Primitive*> *out) const;
+
+  void replay(Render3D *r) const;
+
+  // Recorded with each primitive. Pickable ones can be found under the
+  // mouse cursor by their item ID (see Engine::item_at()).
+  bool pickable{false};
+  uint64_t itemid{ITEM_NON_EXISTING_ID};
+
+ private:
+  void add(std::vector<Primitive> *dst, Primitive::primitive_type_t type,
+           Coords3D a, Coords3D b, texture_handle_t texture);
+
+  ImageManager *img;
+  std::vector<Primitive> stages[STAGES];
+  std::vector<size_t> rows;  // Stage 4 row starts.
 };
 
 // In game console (i.e. text field + input box).
 class Console {
  public:
   Console(unsigned int w, unsigned int h, float fadeout) :
-    line_time(size_t(h), std::numeric_limits<float>::max()),
     fadeout_time{fadeout},
     c{w, h}, tmp{w, h},
+    strips(h / (FONT_H + 2) + 2),
     time_start{std::chrono::steady_clock::now()} { }
 
   void set_text_renderer(TextRenderer *txt);
 
   void render_to(Canvas *dst, int x, int y);
+  void render_to(UILayer *dst, int x, int y);
   void puts(const std::string& s);
 
   void set_prompt(const std::string& new_prompt, bool show);
   std::string& input_text();  // Caller can directly change input text.
 
  private:
-  std::vector<float> line_time;
+  template<typename T> void render_worker(T *dst, int x, int y);
+  void fade_strips();
+  void compose();
+
   float fadeout_time;
-  Canvas c;
+  Canvas c;  // Put together from the strips when needed.
   Canvas tmp;
+  uint64_t revision = 0;  // Of the pixels in c.
+  bool composed = true;
+
+  // Every puts() adds a strip with just the lines it rendered, and the ones
+  // which scrolled out of the console are dropped. This is a ring, oldest
+  // first. A strip is at least one line high, so the ring never overflows.
+  struct Strip {
+    std::unique_ptr<Canvas> c;  // nullptr once faded out completely.
+    int h;
+    float time;  // When it was added.
+    uint8_t alpha;  // Of all non-transparent pixels, 255 for as they are.
+  };
+
+  std::vector<Strip> strips;
+  size_t strips_first = 0;
+  size_t strips_count = 0;
+  int strips_height = 0;
+  CanvasPool pool;
 
   std::string prompt;
   bool show_input_prompt = false;
@@ -318,42 +815,92 @@ class Console {
   TextRenderer *txt;  // Console is NOT the owner of this.
 };
 
+// Rendering quality, picked at startup. The lower ones render the 3D view in
+// a lower resolution (scaled up afterwards) and/or not as far, in exchange
+// for less CPU time per frame.
+struct QualityPreset {
+  const char *name;
+  int downscale;  // 1 for full resolution, 2 for half.
+  int view_distance;  // In tiles, at most VIEWING_DISTANCE.
+  int view_distance_items;
+};
+
+const QualityPreset *find_quality_preset(const std::string& name);
+
 class Engine {
  public:
   Engine()
       : c{WIDTH_UI, HEIGHT_UI},
         r3d{&c, &img},
+        hud{WIDTH_UI, HEIGHT_UI},
         in_game_text{WIDTH_UI - 20, HEIGHT_UI - 75, 10.0f},
         debug_con{WIDTH_UI - 20, HEIGHT_UI - 20, -1.0f},
-        map_c{60, 60} {
+        map_c{60, 60},
+        scene{&img} {
     IMG_Init(IMG_INIT_PNG);
   };
 
   ~Engine() {
+    {
+      std::lock_guard<std::mutex> lock(band_mutex);
+      band_end = true;
+    }
+    band_job_cv.notify_all();
+    for (auto& t : band_threads) {
+      t.join();
+    }
+
     IMG_Quit();
   };
 
+  // Must be called before initialize(), which starts the threads. 1 means
+  // the 3D view is rendered on the calling thread only.
+  void set_render_threads(int n);
+
+  // Same as above.
+  void set_quality(const QualityPreset *preset);
+
+  // Wall clock time the 3D view may take to render, in milliseconds (with
+  // all the render threads working on it at once). The view distance is then
+  // adjusted to stay within it (see govern_view_distance()). 0 means no
+  // limit.
+  void set_frame_budget(float ms);
+
   bool initialize();
   void render_frame(GameState *state);
 
-  void blit_item(const std::string& name, Canvas *dst, int x, int y);
+  // Uses idle time to render one of the views the player is likely to see
+  // next (turning left/right, stepping forward) into the frame cache. Returns
+  // false if there is nothing left to pre-render.
+  bool prerender(GameState *state);
+
+  void blit_item(texture_handle_t h, UILayer *dst, int x, int y);
 
   ImageManager img;
   WorldMap world;
   Canvas c;
   Render3D r3d;
+  UILayer hud;
   Console in_game_text;
   Console debug_con;
   std::unique_ptr<TextRenderer> txt;
 
  private:
-  void render_at(GameState *state, int x, int y, int dir);
+  // Returns the 3D view (owned by the frame cache), or nullptr.
+  const Canvas *render_at(GameState *state, int x, int y, int dir);
+  void build_display_list(
+      DisplayList *dl, GameState *state, int x, int y,
+      Coords iter_external, Coords iter_internal);
+  // Speculative views (see prerender()) don't start a new generation of the
+  // projection cache, otherwise the next real frame would start cold.
+  void render_view(
+      Render3D *r, const DisplayList *dl, int y, bool speculative);
   void render_items_at(
-      GameState *state,
+      DisplayList *dl, GameState *state,
       int map_x, int map_y,
       float x, float z, bool standing_on);
   void render_mobs_at(
-      GameState *state,
+      DisplayList *dl, GameState *state,
       int map_x, int map_y,
       float x, float z, bool standing_on);
   void draw_ui(GameState *state);
@@ -372,17 +919,221 @@ class Engine {
     return dx + dy < 8;
   }
 
-  void tile_grassland(int stage, float x, float z, WorldMap::Tile t);
-  void tile_water(int stage, float x, float z, WorldMap::Tile t);
-  void tile_mountains(int stage, float x, float z, WorldMap::Tile t);
-  void tile_sand(int stage, float x, float z, WorldMap::Tile t);
-  void tile_forest(int stage, float x, float z, WorldMap::Tile t);
-  void tile_rocky_road(int stage, float x, float z, WorldMap::Tile t);
-  void tile_dirt_road(int stage, float x, float z, WorldMap::Tile t);
-  void tile_stone_wall(int stage, float x, float z, WorldMap::Tile t);
-  void tile_wood_floor(int stage, float x, float z, WorldMap::Tile t);
+  // What the sprite pass needs to know about an item/mob texture, indexed by
+  // its handle so that nothing is looked up by name while rendering.
+  struct SpriteInfo {
+    bool valid;
+    float w3d, h3d;  // Size in meters.
+    bool has_position;  // Preferred position is set (items only).
+    float x3d, y3d, z3d;
+  };
+
+  const SpriteInfo& item_sprite(texture_handle_t h);
+  const SpriteInfo& mob_sprite(texture_handle_t h);
+
+  std::vector<SpriteInfo> item_sprites;
+  std::vector<SpriteInfo> mob_sprites;
+
+  void tile_grassland(
+      DisplayList *dl, float x, float z, WorldMap::Tile t);
+  void tile_water(
+      DisplayList *dl, float x, float z, WorldMap::Tile t);
+  void tile_mountains(
+      DisplayList *dl, float x, float z, WorldMap::Tile t);
+  void tile_sand(
+      DisplayList *dl, float x, float z, WorldMap::Tile t);
+  void tile_forest(
+      DisplayList *dl, float x, float z, WorldMap::Tile t);
+  void tile_rocky_road(
+      DisplayList *dl, float x, float z, WorldMap::Tile t);
+  void tile_dirt_road(
+      DisplayList *dl, float x, float z, WorldMap::Tile t);
+  void tile_stone_wall(
+      DisplayList *dl, float x, float z, WorldMap::Tile t);
+  void tile_wood_floor(
+      DisplayList *dl, float x, float z, WorldMap::Tile t);
+
+  // Textures used by the above, looked up once in initialize().
+  struct {
+    texture_handle_t grass[4];
+    texture_handle_t water[4];
+    texture_handle_t rock, rock_dark, rock_light;
+    texture_handle_t sand[4];
+    std::vector<texture_handle_t> trees;  // Indexed like TREE_TYPES.
+    texture_handle_t rocky_road[4];
+    texture_handle_t dirt[4];
+    texture_handle_t wall, wall_door;
+    texture_handle_t wood;
+  } tile_textures{};
+
+  void init_tile_textures();
+
+  // Same for the UI (see draw_ui() and map_at()).
+  struct {
+    texture_handle_t map_bg, map_icons, map_dir;
+    texture_handle_t button_off, button_on;
+    texture_handle_t icon_inv_idle, icon_inv_hover, icon_inv_pressed;
+    texture_handle_t icon_magic_idle, icon_magic_hover, icon_magic_pressed;
+    texture_handle_t icon_cast_idle, icon_cast_hover, icon_cast_pressed;
+    texture_handle_t border_B;
+    texture_handle_t bar_health_bg, bar_health, bar_mana_bg, bar_mana;
+    texture_handle_t hud_inv, hud_spell;
+    texture_handle_t hand_left, hand_right;
+    texture_handle_t portrait_m, portrait_f;
+    texture_handle_t dir_frame;
+    texture_handle_t dir[4];  // Indexed by direction.
+  } ui_textures{};
+
+  void init_ui_textures();
+
+  int downscale = 1;
+  int view_distance = VIEWING_DISTANCE;
+  int view_distance_items = VIEWING_DISTANCE_ITEMS;
+
+  // Frame time governor. Keeps a running average of how long the 3D view
+  // takes to render and moves the view distance between a floor and the
+  // preset's distance accordingly.
+  struct {
+    float budget_ms;  // 0 if disabled.
+    float avg_ms;
+    int samples;  // Since the last change.
+    int max_view_distance;
+    int max_view_distance_items;
+  } governor{};
+
+  void govern_view_distance(float ms);
+  std::unique_ptr<Canvas> low_c;  // Only if the 3D view is downscaled.
+  std::unique_ptr<Canvas> low_sky;
 
   Canvas map_c;
+  uint64_t map_c_revision = 0;  // Position and world revision it shows.
+
+  // Everything the 3D view depends on. The ground stamp is a hash of the
+  // items and mobs around the position (see ground_stamp()), so changes far
+  // away don't invalidate anything.
+  struct SceneKey {
+    int x, y, dir;
+    uint64_t world_revision;
+    uint64_t ground_stamp;
+    int view_distance;
+
+    bool operator==(const SceneKey& o) const {
+      return x == o.x && y == o.y && dir == o.dir &&
+             world_revision == o.world_revision &&
+             ground_stamp == o.ground_stamp &&
+             view_distance == o.view_distance;
+    }
+  };
+
+  uint64_t ground_stamp(GameState *state, int x, int y);
+
+  // Hash of the items/mobs at each non-empty position, rebuilt only when the
+  // ground revision changes. The stamps are summed up from these.
+  struct GroundHash {
+    int x, y;
+    uint64_t hash;
+  };
+
+  std::vector<GroundHash> ground_hashes;
+  uint64_t ground_hashes_revision = 0;
+  bool ground_hashes_valid = false;
+
+  // Last few computed stamps. Pre-rendering asks about the position in front
+  // of the player too, so one isn't enough.
+  struct GroundStampMemo {
+    int x, y;
+    uint64_t ground_revision;
+    uint64_t stamp;
+    bool valid;
+  };
+
+  static const int GROUND_STAMP_MEMO_SIZE = 4;
+  GroundStampMemo ground_stamp_memo[GROUND_STAMP_MEMO_SIZE]{};
+  int ground_stamp_memo_next = 0;  // Slot to overwrite next.
+
+  // The display list of the last rendered position. As long as the player
+  // doesn't move/turn and nothing changes on the ground it's just replayed.
+  DisplayList scene;
+  std::vector<const DisplayList::Primitive*> pickables;  // Scratch.
+  Render3D::QuadSpans pick_spans;  // Same.
+  SceneKey scene_key{};
+  bool scene_valid = false;
+
+  // A pickable sprite as drawn in a frame. The cursor is tested against
+  // these only when needed, instead of tracking item IDs per pixel while
+  // drawing. The Z-buffer is long gone by then (and it's shared by all the
+  // frames anyway), so whatever was drawn in front of the sprite is kept as
+  // a mask.
+  struct PickQuad {
+    uint64_t itemid;
+    Coords3D s, e;
+    const Canvas *texture;
+    float z;
+    int x, y, w, h;  // Screen rectangle, in the 3D view.
+    std::vector<bool> occluded;  // w * h.
+  };
+
+  // Recently rendered 3D frames, most recently used first. Turning around
+  // and stepping back and forth skips rendering altogether.
+  struct FrameCacheEntry {
+    SceneKey key;
+    Canvas frame{WIDTH_UI, HEIGHT_UI};
+    std::vector<PickQuad> picks;  // In the order they were drawn.
+  };
+
+  static const size_t FRAME_CACHE_SIZE = 8;
+
+  std::list<FrameCacheEntry>::iterator frame_cache_find(const SceneKey& key);
+
+  // Speculative entries are put right after the current frame.
+  std::list<FrameCacheEntry>::iterator frame_cache_new_entry(bool speculative);
+  void frame_cache_collect_picks(FrameCacheEntry *entry);
+
+  // Item ID at the given pixel of the 3D view (in UI coordinates) in the
+  // current frame.
+  uint64_t item_at(int x, int y);
+
+  std::list<FrameCacheEntry> frame_cache;
+
+  // Renders the 3D view into a new frame cache entry.
+  std::list<FrameCacheEntry>::iterator render_scene(
+      GameState *state, const SceneKey& key, bool speculative);
+
+  // Position for which all the pre-rendered views are already cached.
+  struct {
+    int x, y, dir;
+    uint64_t world_revision;
+    uint64_t ground_revision;
+    bool valid;
+  } prerender_done{};
+
+  // Banded multi-threaded rendering of the 3D view. Each band is a Render3D
+  // sharing the buffers with r3d, but clipped to its own range of rows.
+  struct BandJob {
+    const DisplayList *dl;
+    int y;
+    bool speculative;
+  };
+
+  // Splits r3d into bands, once it's fully set up (the bands copy its
+  // settings).
+  void create_bands();
+  void band_worker(int band);
+
+  // The renderer which drew the given row of the 3D view (and so owns its
+  // part of the Z-buffer).
+  Render3D *render3d_for_row(int y);
+
+  int render_threads = 1;
+  std::vector<std::unique_ptr<Render3D>> bands;
+  std::vector<std::thread> band_threads;
+  std::mutex band_mutex;
+  std::condition_variable band_job_cv;
+  std::condition_variable band_done_cv;
+  BandJob band_job{};
+  uint64_t band_frame = 0;
+  int band_pending = 0;
+  bool band_end = false;
 };
 
 
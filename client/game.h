@@ -12,6 +12,10 @@ struct Config {
   std::string host_address;
   uint16_t    host_port;
   uint8_t     player_id;
+  int         render_threads;
+  bool        prerender;
+  std::string quality;
+  float       frame_budget_ms;
 };
 
 struct NetworkingThreadContext {
@@ -30,6 +34,12 @@ struct NetworkingThreadContext {
   // Communication between threads.
   SyncedQueue<EventGameNet> *queue_game_from = nullptr;
   SyncedQueue<EventNetGame> *queue_game_to = nullptr;
+
+  // Notified on queue_game_from pushes (the sender thread sleeps on it).
+  Wakeup *wakeup = nullptr;
+
+  // The main thread's one, which needs to know when the threads exit.
+  Wakeup *main_wakeup = nullptr;
 };
 
 struct GameThreadContext {
@@ -45,6 +55,9 @@ struct GameThreadContext {
   SyncedQueue<EventNetGame> *queue_net_from = nullptr;
   SyncedQueue<EventGameUI> *queue_ui_to = nullptr;
   SyncedQueue<EventUIGame> *queue_ui_from = nullptr;
+
+  // Notified on both queue_net_from and queue_ui_from pushes.
+  Wakeup *wakeup = nullptr;
 };
 
 struct UIThreadContext {
@@ -55,5 +68,8 @@ struct UIThreadContext {
   // Communication between threads.
   SyncedQueue<EventGameUI> *queue_game_from = nullptr;
   SyncedQueue<EventUIGame> *queue_game_to = nullptr;
+
+  // Notified on queue_game_from pushes, and when any of the threads exit.
+  Wakeup *wakeup = nullptr;
 };
 
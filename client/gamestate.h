@@ -89,6 +89,9 @@ struct GameState {
       uint64_t,
       std::vector<SimpleMob>> ground_mobs;
 
+  // Bumped whenever ground_items or ground_mobs change.
+  uint64_t ground_revision = 0;
+
   // Item ID to SimpleItem map.
   std::unordered_map<uint64_t, SimpleItem> item_id_to_item;
   std::unordered_map<uint64_t, SimpleMob> mob_id_to_mob;
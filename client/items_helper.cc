@@ -79,10 +79,10 @@ std::list<std::string> item_sprite_map_keys() {
   return keys;
 }
 
-item_sprite_t item_to_sprite_info(const std::string& name) {
+const item_sprite_t& item_to_sprite_info(const std::string& name) {
   auto ret = sprite_map.find(name);
   if (ret == sprite_map.end()) {
-    return sprite_map["__default"];
+    return sprite_map.at("__default");
   }
 
   return ret->second;
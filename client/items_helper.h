@@ -17,5 +17,5 @@ struct item_sprite_t {
 
 void init_sprite_map();
 std::list<std::string> item_sprite_map_keys();
-item_sprite_t item_to_sprite_info(const std::string& name);
+const item_sprite_t& item_to_sprite_info(const std::string& name);
 
@@ -186,9 +186,11 @@ bool GameLogic::process_net_event() {
 
   if (p->get_chunk_id() == "GRND"s) {
     state.ground_items.clear();
+    state.ground_revision++;
     PacketsSC_GRND *grnd = (PacketsSC_GRND*)p.get();
-    for (const auto& itemlist : grnd->lists) {
-      for (const auto& item : itemlist.items) {
+    for (auto& itemlist : grnd->lists) {
+      for (auto& item : itemlist.items) {
+        item.gfx_handle = ctx->e->img.handle(item.gfx_id);
         state.item_id_to_item[item.id] = item;
       }
 
@@ -200,8 +202,10 @@ bool GameLogic::process_net_event() {
 
   if (p->get_chunk_id() == "MOBS"s) {
     state.ground_mobs.clear();
+    state.ground_revision++;
     PacketsSC_MOBS *mobs = (PacketsSC_MOBS*)p.get();
-    for (const auto& mob : mobs->moblist) {
+    for (auto& mob : mobs->moblist) {
+      mob.gfx_handle = ctx->e->img.handle(mob.gfx_id);
       state.mob_id_to_mob[mob.id] = mob;
 
       if (mob.visible) {
@@ -261,7 +265,8 @@ bool GameLogic::process_net_event() {
            "  Inventory:\n");*/
 
     for (int i = 0; i < 8; i++) {
-      const auto& item = invt->inventory[i];
+      auto& item = invt->inventory[i];
+      item.gfx_handle = ctx->e->img.handle(item.gfx_id);
       state.inventory[i] = item;
       state.item_id_to_item[item.id] = item;
 
@@ -278,7 +283,8 @@ bool GameLogic::process_net_event() {
 
     //printf("  Equipment:\n");
     for (int i = 0; i < 2; i++) {
-      const auto& item = invt->equipment[i];
+      auto& item = invt->equipment[i];
+      item.gfx_handle = ctx->e->img.handle(item.gfx_id);
       state.equiped[i] = item;
       state.item_id_to_item[item.id] = item;
 
@@ -321,8 +327,9 @@ bool GameLogic::process_net_event() {
   if (p->get_chunk_id() == "HLDI"s) {
     PacketsSC_HLDI *hldi = (PacketsSC_HLDI*)p.get();
     state.holding = hldi->item;
+    state.holding.gfx_handle = ctx->e->img.handle(state.holding.gfx_id);
     if (state.holding.id != ITEM_NON_EXISTING_ID) {
-      auto img = ctx->e->img.get(hldi->item.gfx_id);
+      auto img = ctx->e->img.get(state.holding.gfx_handle);
       int hx = img->w / 2;
       int hy = img->h / 2;
       ctx->queue_ui_to->push(
@@ -861,6 +868,21 @@ void GameLogic::console_command_cfg_passwd(
   ctx->e->debug_con.puts("Config decryption password set.");
 }
 
+void GameLogic::console_command_txt_stats(
+    std::string /*command*/, std::vector<std::string> /*args*/) {
+  const auto& stats = ctx->e->txt->cache_stats();
+  char msg[256];
+  snprintf(msg, sizeof(msg),
+           "Text cache: %zu entries, %zu KB (budget %zu KB)\n"
+           "  %llu hits, %llu misses, %llu evictions",
+           stats.entries, stats.bytes / 1024,
+           TextRenderer::CACHE_BUDGET / 1024,
+           (unsigned long long)stats.hits,
+           (unsigned long long)stats.misses,
+           (unsigned long long)stats.evictions);
+  ctx->e->debug_con.puts(msg);
+}
+
 void GameLogic::console_command_help(
     std::string /*command*/, std::vector<std::string> /*args*/) {
   ctx->e->debug_con.puts(
@@ -871,6 +893,7 @@ void GameLogic::console_command_help(
       "                        0 - None." "\n"
       "                        1 - AES-128-ECB with MD5(password) as key." "\n"
       "  cfgpasswd <passwd>   Set decryption password for config file." "\n"
+      "  txtstats              Print text cache statistics." "\n"
       "  quit                  Take a guess."
   );
 }
@@ -886,6 +909,7 @@ void GameLogic::main(GameThreadContext *ctx) {
   console_commands["cfgdump"] = &GameLogic::console_command_cfg_dump;
   console_commands["cfgscheme"] = &GameLogic::console_command_cfg_scheme;
   console_commands["cfgpasswd"] = &GameLogic::console_command_cfg_passwd;
+  console_commands["txtstats"] = &GameLogic::console_command_txt_stats;
 
   // Some welcome messages.
   ctx->e->debug_con.puts("\x12""Arcane Sector\x0f"" debug console.");
@@ -905,6 +929,7 @@ void GameLogic::main(GameThreadContext *ctx) {
   auto last_ping = std::chrono::steady_clock::now();
 
   while (!ctx->end) {
+    const uint32_t ticket = ctx->wakeup->ticket();
     state.now = std::chrono::steady_clock::now();
     bool processed_any_events =
         this->process_ui_event() ||
@@ -920,8 +945,16 @@ void GameLogic::main(GameThreadContext *ctx) {
             PacketsCS_PING::make().release()});
       }
 
-      // Good night.
-      std::this_thread::sleep_for(std::chrono::milliseconds(5));
+      // Nothing to do, so get the next frames ready in advance.
+      if (ctx->config->prerender && ctx->e->prerender(&state)) {
+        continue;
+      }
+
+      // Good night (until an event comes, or it's time for the next ping).
+      const auto until_ping = std::chrono::ceil<std::chrono::milliseconds>(
+          last_ping + std::chrono::seconds(30) - state.now);
+      ctx->wakeup->wait(
+          ticket, std::max(until_ping, std::chrono::milliseconds(1)));
     }
   }
 }
@@ -61,6 +61,8 @@ class GameLogic {
                                   std::vector<std::string> args);
   void console_command_cfg_passwd(std::string command,
                                   std::vector<std::string> args);
+  void console_command_txt_stats(std::string command,
+                                 std::vector<std::string> args);
   void console_conf_decrypt(std::vector<uint8_t>& data);
   void console_hexii_dump(uint8_t *data, size_t sz);
 
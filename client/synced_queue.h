@@ -1,39 +1,116 @@
 #pragma once
-#include <list>
+#include <atomic>
+#include <vector>
 #include <thread>
-#include <mutex>
+#include <functional>
+#include <algorithm>
+#include "wakeup.h"
 
+// A bounded lock-free queue for exactly one producer thread (push) and one
+// consumer thread (pop). Each queue between the threads has one of each, so
+// there is no need for a lock, nor for allocating anything per element.
 template<typename T>
 class SyncedQueue {
  public:
+  // The capacity is rounded up to a power of two.
+  explicit SyncedQueue(size_t capacity = 1024) {
+    size_t sz = 1;
+    while (sz < capacity) {
+      sz <<= 1;
+    }
+
+    ring.resize(sz);
+    mask = sz - 1;
+  }
+
+  // Called by push() whenever the queue is full, with the element that is
+  // being pushed. Returning true means "wait for the consumer and try again",
+  // false drops the element (the hook has to free whatever it owns then).
+  // Without a hook push() just waits. Set it before the threads start.
+  void set_overflow_hook(std::function<bool(const T&)> hook) {
+    overflow_hook = std::move(hook);
+  }
+
+  // Notified on every push, so that the consumer can sleep until there's
+  // something to pop. Several queues can share one. Set it before the threads
+  // start.
+  void set_wakeup(Wakeup *w) {
+    wakeup = w;
+  }
+
+  // Consumer side.
   bool pop(T *el) {
-    std::lock_guard<std::mutex> guard(m);
-    if (queue.empty()) {
-      return false;
+    return pop(el, 1) == 1;
+  }
+
+  // Pops up to max elements at once. Returns how many were popped.
+  size_t pop(T *els, size_t max) {
+    const size_t h = head.load(std::memory_order_relaxed);
+    if (tail_cache - h < max) {
+      tail_cache = tail.load(std::memory_order_acquire);
+    }
+
+    const size_t count = std::min(max, tail_cache - h);
+    for (size_t i = 0; i < count; i++) {
+      els[i] = std::move(ring[(h + i) & mask]);
     }
 
-    *el = queue.front();
-    queue.pop_front();
-    return true;
+    if (count != 0) {
+      head.store(h + count, std::memory_order_release);
+    }
+
+    return count;
   }
 
+  // Both are just a snapshot when called from the other side.
   bool empty() const {
-    std::lock_guard<std::mutex> guard(m);
-    return queue.empty();
+    return size() == 0;
   }
 
   size_t size() const {
-    std::lock_guard<std::mutex> guard(m);
-    return queue.size();
+    const size_t h = head.load(std::memory_order_acquire);
+    return tail.load(std::memory_order_acquire) - h;
   }
 
+  // Producer side.
   void push(T el) {
-    std::lock_guard<std::mutex> guard(m);
-    queue.push_back(el);
+    const size_t t = tail.load(std::memory_order_relaxed);
+    while (t - head_cache > mask) {
+      head_cache = head.load(std::memory_order_acquire);
+      if (t - head_cache <= mask) {
+        break;
+      }
+
+      if (overflow_hook && !overflow_hook(el)) {
+        return;
+      }
+
+      std::this_thread::yield();
+    }
+
+    ring[t & mask] = std::move(el);
+    tail.store(t + 1, std::memory_order_release);
+
+    if (wakeup != nullptr) {
+      wakeup->notify();
+    }
   }
 
  private:
-  std::mutex m;
-  std::list<T> queue;
-};
+  // The producer and the consumer each get their own cache line, so that
+  // they don't keep stealing it from each other. Both keep a copy of the
+  // other side's index, and only look at the real one when the copy says
+  // the queue is full/empty.
+  static const size_t CACHE_LINE = 64;
 
+  alignas(CACHE_LINE) std::atomic<size_t> head{0};  // Next to pop.
+  size_t tail_cache = 0;
+
+  alignas(CACHE_LINE) std::atomic<size_t> tail{0};  // Next to push.
+  size_t head_cache = 0;
+
+  alignas(CACHE_LINE) std::vector<T> ring;
+  size_t mask;
+  std::function<bool(const T&)> overflow_hook;
+  Wakeup *wakeup = nullptr;
+};
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdio.h>
+
+// Minimal checks for the tests in this directory. A failed check is printed
+// and counted, and the test carries on; main() returns check_failures() != 0.
+inline int& check_failures() {
+  static int failures = 0;
+  return failures;
+}
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%i: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      check_failures()++; \
+    } \
+  } while (0)
@@ -0,0 +1,50 @@
+#pragma once
+#include <random>
+#include <string>
+#include "../engine.h"
+
+// Random glyphs laid out like simple_6x8.png, rune_bg.png and runes.png.
+// Alphas are picked around the a >= 200 threshold of the text renderer.
+struct FakeFont {
+  Canvas font{(0x7e - 0x20) * FONT_W, FONT_H};
+  Canvas rune_bg{8 * FONT_W * 2, FONT_H};
+  Canvas runes{8 * FONT_W, FONT_H};
+
+  explicit FakeFont(unsigned seed) {
+    std::mt19937 rng(seed);
+    for (Canvas *c : { &font, &rune_bg, &runes }) {
+      for (RGBA& px : c->d) {
+        static const uint8_t alphas[] = { 0, 0, 0, 100, 199, 200, 230, 255 };
+        px = RGBA{ (uint8_t)rng(), (uint8_t)rng(), (uint8_t)rng(),
+                   alphas[rng() % 8] };
+      }
+    }
+  }
+};
+
+// Words, spaces, newlines, color codes and spells, roughly in the proportions
+// the game uses them, plus some junk bytes.
+inline std::string random_text(std::mt19937 *rng, size_t max_len) {
+  std::string s;
+  const size_t len = (*rng)() % (max_len + 1);
+  while (s.size() < len) {
+    const unsigned r = (*rng)() % 100;
+    if (r < 60) {
+      s += (char)(0x21 + (*rng)() % (0x7f - 0x21));
+    } else if (r < 75) {
+      s += ' ';
+    } else if (r < 78) {
+      s += '\n';
+    } else if (r < 80) {
+      s += '\t';
+    } else if (r < 88) {
+      s += (char)(0x0f + (*rng)() % 0x11);
+    } else if (r < 96) {
+      s += (char)0xff;
+      s += (char)(0x38 + (*rng)() % 0x50);  // Some of them aren't runes.
+    } else {
+      s += (char)((*rng)() % 0x100);
+    }
+  }
+  return s;
+}
@@ -0,0 +1,143 @@
+// Checks the single producer/consumer ring: the capacity, wrapping around,
+// batch pops, the overflow hook, and two threads actually using it.
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "../synced_queue.h"
+#include "check.h"
+
+namespace {
+
+// Pushes count values starting at first, and pops them back up to max at a
+// time.
+void push_pop(SyncedQueue<int> *q, int first, int count, size_t max) {
+  for (int i = 0; i < count; i++) {
+    q->push(first + i);
+  }
+  CHECK(q->size() == (size_t)count);
+
+  int expected = first;
+  int els[16];
+  while (expected != first + count) {
+    const size_t popped = q->pop(els, max);
+    CHECK(popped == std::min(max, (size_t)(first + count - expected)));
+    for (size_t i = 0; i < popped; i++) {
+      CHECK(els[i] == expected++);
+    }
+    if (popped == 0) {
+      break;
+    }
+  }
+  CHECK(q->empty());
+}
+
+}  // namespace
+
+int main() {
+  // Rounded up to 8, so the 9th push is the first one that doesn't fit.
+  {
+    SyncedQueue<int> q(5);
+    int overflows = 0;
+    int dropped = -1;
+    q.set_overflow_hook([&](const int& el) {
+      overflows++;
+      dropped = el;
+      return false;
+    });
+
+    for (int i = 0; i < 8; i++) {
+      q.push(i);
+    }
+    CHECK(overflows == 0);
+    CHECK(q.size() == 8);
+
+    q.push(8);
+    CHECK(overflows == 1);
+    CHECK(dropped == 8);
+    CHECK(q.size() == 8);
+
+    // There's room again after a pop.
+    int el = -1;
+    CHECK(q.pop(&el) && el == 0);
+    q.push(9);
+    CHECK(overflows == 1);
+    for (int i = 1; i < 8; i++) {
+      CHECK(q.pop(&el) && el == i);
+    }
+    CHECK(q.pop(&el) && el == 9);
+    CHECK(!q.pop(&el));
+  }
+
+  // Every fill level against every batch size, many times around the ring.
+  {
+    SyncedQueue<int> q(8);
+    int next = 0;
+    for (int round = 0; round < 100; round++) {
+      for (int count = 1; count <= 8; count++) {
+        for (size_t max = 1; max <= 9; max++) {
+          push_pop(&q, next, count, max);
+          next += count;
+        }
+      }
+    }
+  }
+
+  // Elements are moved in and out, not copied.
+  {
+    SyncedQueue<std::unique_ptr<int>> q(2);
+    for (int i = 0; i < 10; i++) {
+      q.push(std::make_unique<int>(i));
+      std::unique_ptr<int> el;
+      CHECK(q.pop(&el) && el != nullptr && *el == i);
+    }
+  }
+
+  // A full queue with a hook which says "wait" loses nothing, and so doesn't
+  // one without a hook. The consumer pops in random sized batches.
+  for (bool with_hook : { true, false }) {
+    const int COUNT = 200000;
+    SyncedQueue<int> q(16);
+    std::atomic<int> overflows{0};
+    if (with_hook) {
+      q.set_overflow_hook([&](const int&) {
+        overflows++;
+        return true;
+      });
+    }
+
+    std::vector<int> received;
+    std::thread consumer([&] {
+      // Let the producer hit the hook at least once.
+      while (with_hook && overflows == 0) {
+        std::this_thread::yield();
+      }
+
+      unsigned rnd = 1;
+      int els[32];
+      while (received.size() != COUNT) {
+        rnd = rnd * 1103515245 + 12345;
+        const size_t popped = q.pop(els, 1 + (rnd >> 16) % 32);
+        received.insert(received.end(), els, els + popped);
+        if (popped == 0) {
+          std::this_thread::yield();
+        }
+      }
+    });
+
+    for (int i = 0; i < COUNT; i++) {
+      q.push(i);
+    }
+    consumer.join();
+
+    bool in_order = true;
+    for (int i = 0; i < COUNT; i++) {
+      in_order = in_order && received[i] == i;
+    }
+    CHECK(in_order);
+    CHECK(q.empty());
+    CHECK(!with_hook || overflows > 0);
+  }
+
+  return check_failures() != 0;
+}
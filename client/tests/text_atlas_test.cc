@@ -0,0 +1,323 @@
+// Checks that texts put together from the glyph atlas look exactly like the
+// ones drawn glyph by glyph (which is how TextRenderer used to do it).
+#include <random>
+#include <string>
+#include "../engine.h"
+#include "check.h"
+#include "fake_font.h"
+
+namespace {
+
+// The direct renderer, as it was before the atlas.
+class ReferenceText {
+ public:
+  explicit ReferenceText(const FakeFont *f) : f_(f) {}
+
+  int render(Canvas *dst, int w, int h, const std::string& text) {
+    const RGBA color_scheme[] {
+      { 1,1,1,255 },
+      { 222,56,43,255 },
+      { 57,181,74,255 },
+      { 255,199,6,255 },
+      { 0,111,184,255 },
+      { 118,38,113,255 },
+      { 44,181,233,255 },
+      { 204,204,204,255 },
+      { 128,128,128,255 },
+      { 255,0,0,255 },
+      { 0,255,0,255 },
+      { 255,255,0,255 },
+      { 0,0,255,255 },
+      { 255,0,255,255 },
+      { 0,255,255,255 },
+      { 255,255,255,255 }
+    };
+
+    RGBA current_color = color_scheme[DEFAULT_TEXT_COLOR];
+
+    int x = 1;
+    int y = 1;
+    size_t i = 0;
+    int lines_rendered = 1;
+    while (i != text.size()) {
+      if (x + FONT_W + 1 > w) {
+        x = 1;
+        y += FONT_H;
+        lines_rendered++;
+      }
+
+      if (y + FONT_H + 1 > h) {
+        break;
+      }
+
+      unsigned char ch = (unsigned char)text[i];
+
+      if (ch == '\n') {
+        i++;
+        x = 1;
+        y += FONT_H;
+        lines_rendered++;
+        continue;
+      }
+
+      if (ch == ' ' || ch == '\t') {
+        i++;
+        x += FONT_W;
+        continue;
+      }
+
+      int word_w = 0;
+      size_t end_i = i;
+      for (size_t j = i; j < text.size(); j++) {
+        unsigned char ch = (unsigned char)text[j];
+
+        if (ch == 0x0f || (ch >= 0x10 && ch <= 0x1f)) {
+          end_i++;
+          continue;
+        }
+
+        if (ch == ' ' || ch == '\n' || ch == '\t') {
+          break;
+        }
+
+        word_w += FONT_W;
+        end_i++;
+      }
+
+      int space_left = w - x;
+      if (word_w + 1 > space_left && word_w + 1 <= w) {
+        x = 1;
+        y += FONT_H;
+        lines_rendered++;
+
+        if (y + FONT_H + 1 > h) {
+          break;
+        }
+      }
+
+      bool is_next_spell = false;
+      for (size_t j = i; j < end_i; j++) {
+        unsigned char ch = (unsigned char)text[j];
+
+        if (is_next_spell) {
+          is_next_spell = false;
+
+          int space_left = w - x;
+          if (space_left < 2 * FONT_W + 1) {
+            x = 1;
+            y += FONT_H;
+            lines_rendered++;
+          }
+
+          if (y + FONT_H + 1 > h) {
+            break;
+          }
+
+          render_rune(dst, x, y, ch);
+          render_outline(dst, x - 1, y - 1, FONT_W * 2 + 2, FONT_H + 2,
+                         RGBA{0, 0, 0, 128});
+          x += FONT_W * 2;
+          continue;
+        }
+
+        if (ch == 0x0f) {
+          current_color = color_scheme[DEFAULT_TEXT_COLOR];
+          continue;
+        }
+
+        if (ch >= 0x10 && ch <= 0x1f) {
+          current_color = color_scheme[ch - 0x10];
+          continue;
+        }
+
+        if (ch == 0xff) {
+          is_next_spell = true;
+          continue;
+        }
+
+        int space_left = w - x;
+        if (space_left < FONT_W + 1) {
+          x = 1;
+          y += FONT_H;
+          lines_rendered++;
+        }
+
+        if (y + FONT_H + 1 > h) {
+          break;
+        }
+
+        if (ch >= 0x20 && ch <= 0x7d) {
+          render_char(dst, x, y, ch, current_color);
+          render_outline(dst, x - 1, y - 1, FONT_W + 2, FONT_H + 2,
+                         RGBA{0, 0, 0, 192});
+        }
+        x += FONT_W;
+      }
+
+      i = end_i;
+    }
+
+    return i != text.size() ? -lines_rendered : lines_rendered;
+  }
+
+ private:
+  void render_char(Canvas *dst, int x, int y, unsigned char ch, RGBA color) {
+    ch -= 0x20;
+    for (int j = 0; j < FONT_H; j++) {
+      for (int i = 0; i < FONT_W; i++) {
+        const RGBA& src_px = f_->font.d[ch * FONT_W + i + j * f_->font.w];
+        if (src_px.a >= 200) {
+          dst->d[x + i + (y + j) * dst->w] = color;
+        }
+      }
+    }
+  }
+
+  void render_rune(Canvas *dst, int x, int y, unsigned char rune) {
+    if (rune < 0x40 || rune >= 0x80) {
+      return;
+    }
+
+    rune -= 0x40;
+    unsigned char bg = rune / 8;
+    unsigned char fg = rune % 8;
+
+    for (int j = 0; j < FONT_H; j++) {
+      for (int i = 0; i < FONT_W * 2; i++) {
+        const RGBA& bg_px =
+            f_->rune_bg.d[bg * FONT_W * 2 + i + j * f_->rune_bg.w];
+        if (bg_px.a >= 200) {
+          dst->d[x + i + (y + j) * dst->w] = bg_px;
+        }
+      }
+    }
+
+    for (int j = 0; j < FONT_H; j++) {
+      for (int i = 0; i < FONT_W; i++) {
+        const RGBA& fg_px = f_->runes.d[fg * FONT_W + i + j * f_->runes.w];
+        if (fg_px.a >= 200) {
+          dst->d[x + i + 3 + (y + j) * dst->w] = fg_px;
+        }
+      }
+    }
+  }
+
+  void render_outline(Canvas *dst, int x, int y, int w, int h, RGBA outline) {
+    for (int j = 1; j < h - 1; j++) {
+      for (int i = 1; i < w - 1; i++) {
+        if (dst->d[x + i + (y + j) * dst->w].a < 200) {
+          continue;
+        }
+
+        for (int n = -1; n <= 1; n++) {
+          for (int m = -1; m <= 1; m++) {
+            RGBA& px = dst->d[x + i + m + (y + j + n) * dst->w];
+            if (px.a < 200) {
+              px = outline;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  const FakeFont *f_;
+};
+
+bool same_pixels(const Canvas& a, const Canvas& b) {
+  if (a.w != b.w || a.h != b.h) {
+    return false;
+  }
+
+  for (size_t i = 0; i < a.d.size(); i++) {
+    if (a.d[i].r != b.d[i].r || a.d[i].g != b.d[i].g ||
+        a.d[i].b != b.d[i].b || a.d[i].a != b.d[i].a) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Same text through render_uncached() and through the reference.
+void check_text(TextRenderer *txt, ReferenceText *ref,
+                int w, int h, const std::string& text) {
+  Canvas got{(unsigned)w, (unsigned)h};
+  Canvas want{(unsigned)w, (unsigned)h};
+  const int got_lines = txt->render_uncached(&got, w, h, text);
+  const int want_lines = ref->render(&want, w, h, text);
+  CHECK(got_lines == want_lines);
+  CHECK(same_pixels(got, want));
+}
+
+}  // namespace
+
+int main() {
+  FakeFont font(1);
+  TextRenderer txt(&font.font, &font.rune_bg, &font.runes);
+  ReferenceText ref(&font);
+
+  // Every glyph in every color, and every rune (and some non-runes), packed
+  // tightly so that the outlines overlap.
+  std::string all;
+  for (int color = 0x10; color <= 0x1f; color++) {
+    all += (char)color;
+    for (int ch = 0x20; ch <= 0x7e; ch++) {
+      all += (char)ch;
+    }
+  }
+  all += (char)0x0f;
+  for (int rune = 0x38; rune <= 0x88; rune++) {
+    all += (char)0xff;
+    all += (char)rune;
+  }
+  check_text(&txt, &ref, 200, 400, all);
+  check_text(&txt, &ref, 15, 400, all);  // Room for exactly 2 chars a line.
+
+  // Wrapping and running out of space.
+  check_text(&txt, &ref, 1, 1, "x");
+  check_text(&txt, &ref, 100, 20, "");
+  check_text(&txt, &ref, 50, 20, "a few short words that won't fit");
+  check_text(&txt, &ref, 50, 40, "averyveryverylongword\nand\n\n\nmore");
+  check_text(&txt, &ref, 20, 40, "\xff\x40\xff\x41\xff\x7f ab\x12" "cd\xff");
+
+  // Anything narrower than a rune (plus outline) gets drawn past the right
+  // edge, by both renderers.
+  const int MIN_W = FONT_W * 2 + 2;
+
+  std::mt19937 rng(2);
+  for (int n = 0; n < 20000; n++) {
+    const int w = MIN_W + rng() % 160;
+    const int h = 1 + rng() % 80;
+    check_text(&txt, &ref, w, h, random_text(&rng, 120));
+  }
+
+  // The cached path only blits the same thing over whatever is there.
+  for (int n = 0; n < 2000; n++) {
+    const int w = MIN_W + rng() % 160;
+    const int h = 1 + rng() % 80;
+    const int x = rng() % 40;
+    const int y = rng() % 40;
+    const std::string text = random_text(&rng, 120);
+
+    Canvas got{240, 120};
+    for (RGBA& px : got.d) {
+      px = RGBA{ (uint8_t)rng(), (uint8_t)rng(), (uint8_t)rng(),
+                 (uint8_t)rng() };
+    }
+    Canvas want = got;
+
+    Canvas rendered{(unsigned)w, (unsigned)h};
+    const int want_lines = ref.render(&rendered, w, h, text);
+    want.blit(&rendered, 0, 0, x, y, w, h);
+
+    CHECK(txt.render(&got, x, y, w, h, text) == want_lines);
+    CHECK(same_pixels(got, want));
+
+    if (n % 100 == 0) {
+      txt.hint_frame_change();
+    }
+  }
+
+  return check_failures() != 0;
+}
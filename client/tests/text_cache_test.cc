@@ -0,0 +1,152 @@
+// Checks the LRU cache of rendered texts: the byte budget, what gets evicted
+// and when, and that cached texts look the same as freshly rendered ones.
+#include <string.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "../engine.h"
+#include "check.h"
+#include "fake_font.h"
+
+namespace {
+
+const int W = 200;
+const int H = 100;
+
+std::string text_no(int n) {
+  return "text number " + std::to_string(n);
+}
+
+// Without hash collisions every miss adds an entry, and only evictions
+// remove them.
+void check_stats(const TextRenderer& txt) {
+  const TextRenderer::CacheStats& s = txt.cache_stats();
+  CHECK(s.entries == s.misses - s.evictions);
+  CHECK(s.bytes >= s.entries * W * H * sizeof(RGBA) || s.entries == 0);
+}
+
+// Renders the text and tells whether it came from the cache.
+bool render_hit(TextRenderer *txt, Canvas *dst, const std::string& text) {
+  const uint64_t hits = txt->cache_stats().hits;
+  txt->render(dst, 0, 0, W, H, text);
+  return txt->cache_stats().hits == hits + 1;
+}
+
+}  // namespace
+
+int main() {
+  FakeFont font(1);
+  Canvas dst{W, H};
+
+  // Texts used in the current frame are never evicted, even over the budget.
+  const size_t text_bytes = W * H * sizeof(RGBA);
+  const int over_budget = (int)(2 * TextRenderer::CACHE_BUDGET / text_bytes);
+  {
+    TextRenderer txt(&font.font, &font.rune_bg, &font.runes);
+    for (int n = 0; n < over_budget; n++) {
+      CHECK(!render_hit(&txt, &dst, text_no(n)));
+    }
+    CHECK(txt.cache_stats().evictions == 0);
+    CHECK(txt.cache_stats().entries == (size_t)over_budget);
+    CHECK(txt.cache_stats().bytes > TextRenderer::CACHE_BUDGET);
+    CHECK(render_hit(&txt, &dst, text_no(0)));
+    check_stats(txt);
+
+    // The next frame trims it down, the least recently used first. Text 0
+    // was used last, so it stays.
+    txt.hint_frame_change();
+    CHECK(txt.cache_stats().bytes <= TextRenderer::CACHE_BUDGET);
+    CHECK(txt.cache_stats().evictions > 0);
+    check_stats(txt);
+
+    const int evicted = (int)txt.cache_stats().evictions;
+    CHECK(render_hit(&txt, &dst, text_no(0)));
+    CHECK(render_hit(&txt, &dst, text_no(over_budget - 1)));
+    CHECK(render_hit(&txt, &dst, text_no(evicted + 1)));
+    CHECK(!render_hit(&txt, &dst, text_no(evicted)));
+    CHECK(!render_hit(&txt, &dst, text_no(1)));
+    check_stats(txt);
+  }
+
+  // Once full, each new text pushes out the least recently used one, and
+  // using a text makes it the most recent again.
+  {
+    TextRenderer txt(&font.font, &font.rune_bg, &font.runes);
+    int next = 0;
+    while (txt.cache_stats().evictions == 0) {
+      render_hit(&txt, &dst, text_no(next++));
+      txt.hint_frame_change();
+    }
+
+    // Text 0 is gone already, text 1 is the oldest now.
+    const int first = (int)txt.cache_stats().evictions;
+    CHECK(render_hit(&txt, &dst, text_no(first)));
+    txt.hint_frame_change();
+
+    for (int n = 0; n < 10; n++) {
+      CHECK(!render_hit(&txt, &dst, text_no(next++)));
+      txt.hint_frame_change();
+      CHECK(txt.cache_stats().bytes <= TextRenderer::CACHE_BUDGET);
+    }
+
+    CHECK(render_hit(&txt, &dst, text_no(first)));
+    CHECK(render_hit(&txt, &dst, text_no(first + 11)));
+    CHECK(!render_hit(&txt, &dst, text_no(first + 1)));
+    CHECK(!render_hit(&txt, &dst, text_no(first + 10)));
+    check_stats(txt);
+  }
+
+  // The same text in another size is another entry.
+  {
+    TextRenderer txt(&font.font, &font.rune_bg, &font.runes);
+    txt.render(&dst, 0, 0, W, H, "abc");
+    txt.render(&dst, 0, 0, W, H / 2, "abc");
+    txt.render(&dst, 0, 0, W / 2, H, "abc");
+    CHECK(txt.cache_stats().misses == 3);
+    txt.render(&dst, 0, 0, W, H / 2, "abc");
+    CHECK(txt.cache_stats().hits == 1);
+  }
+
+  // Cached texts, drawn on canvases recycled from evicted ones, still look
+  // the same as the uncached ones.
+  {
+    TextRenderer txt(&font.font, &font.rune_bg, &font.runes);
+    std::mt19937 rng(2);
+    std::vector<std::string> texts;
+    for (int n = 0; n < 400; n++) {
+      texts.push_back(random_text(&rng, 300));
+    }
+
+    for (int n = 0; n < 5000; n++) {
+      const std::string& text = texts[rng() % texts.size()];
+      const int w = W - rng() % 4 * 32;
+      const int h = H - rng() % 4 * 16;
+
+      Canvas got{W, H};
+      for (RGBA& px : got.d) {
+        px = RGBA{ (uint8_t)rng(), (uint8_t)rng(), (uint8_t)rng(),
+                   (uint8_t)rng() };
+      }
+      Canvas want = got;
+
+      Canvas rendered{(unsigned)w, (unsigned)h};
+      const int want_lines = txt.render_uncached(&rendered, w, h, text);
+      want.blit(&rendered, 0, 0, 0, 0, w, h);
+
+      CHECK(txt.render(&got, 0, 0, w, h, text) == want_lines);
+      CHECK(got.d.size() == want.d.size() &&
+            memcmp(got.d.data(), want.d.data(),
+                   got.d.size() * sizeof(RGBA)) == 0);
+
+      if (n % 10 == 0) {
+        txt.hint_frame_change();
+        CHECK(txt.cache_stats().bytes <= TextRenderer::CACHE_BUDGET);
+      }
+    }
+
+    CHECK(txt.cache_stats().hits > 0);
+    CHECK(txt.cache_stats().evictions > 0);
+  }
+
+  return check_failures() != 0;
+}
@@ -0,0 +1,88 @@
+// Checks that a Wakeup neither misses a notification nor sleeps through one.
+#include <chrono>
+#include <thread>
+#include "../synced_queue.h"
+#include "../wakeup.h"
+#include "check.h"
+
+namespace {
+
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+milliseconds since(steady_clock::time_point start) {
+  return std::chrono::duration_cast<milliseconds>(steady_clock::now() - start);
+}
+
+}  // namespace
+
+int main() {
+  // A notification between the ticket and the wait isn't lost.
+  {
+    Wakeup w;
+    const uint32_t ticket = w.ticket();
+    w.notify();
+    const auto start = steady_clock::now();
+    w.wait(ticket, Wakeup::FOREVER);
+    CHECK(since(start) < milliseconds(1000));
+  }
+
+  // Nothing to wake up for, so it sleeps until the timeout.
+  {
+    Wakeup w;
+    w.notify();  // Before the ticket, so it doesn't count.
+    const auto start = steady_clock::now();
+    w.wait(w.ticket(), milliseconds(50));
+    CHECK(since(start) >= milliseconds(40));
+  }
+
+  // Another thread wakes up a sleeping one, many times over.
+  {
+    Wakeup w;
+    std::atomic<int> round{-1};
+    std::thread notifier([&] {
+      for (int i = 0; i < 1000; i++) {
+        while (round != i) {
+          std::this_thread::yield();
+        }
+        w.notify();
+      }
+    });
+
+    const auto start = steady_clock::now();
+    for (int i = 0; i < 1000; i++) {
+      const uint32_t ticket = w.ticket();
+      round = i;
+      w.wait(ticket, Wakeup::FOREVER);
+    }
+    notifier.join();
+    CHECK(since(start) < milliseconds(10000));
+  }
+
+  // Every push notifies the queue's wakeup.
+  {
+    Wakeup w;
+    SyncedQueue<int> q(4);
+    q.set_wakeup(&w);
+    const uint32_t ticket = w.ticket();
+    q.push(1);
+    CHECK(w.ticket() != ticket);
+  }
+
+#ifdef __linux__
+  // The extra descriptor wakes it up too.
+  {
+    Wakeup w;
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    CHECK(write(fds[1], "x", 1) == 1);
+    const auto start = steady_clock::now();
+    w.wait(w.ticket(), Wakeup::FOREVER, fds[0]);
+    CHECK(since(start) < milliseconds(1000));
+    close(fds[0]);
+    close(fds[1]);
+  }
+#endif
+
+  return check_failures() != 0;
+}
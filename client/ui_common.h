@@ -20,8 +20,10 @@ class UI {
   virtual bool process_events() = 0;
   virtual void join() {};  // Wait for thread to finish (if any).
 
-  // Is the main thread allowed to sleep a few ms?
-  virtual bool ok_to_yield() = 0;
+  // Sleeps until there might be something to process, i.e. until either the
+  // UI itself or the game has something (see Wakeup for the ticket). Returns
+  // right away if the UI can't sleep.
+  virtual void wait(uint32_t ticket) = 0;
 
  protected:
   UIThreadContext *ctx;
@@ -34,7 +36,7 @@ class UI_WS : public UI {
   ~UI_WS();
   bool initialize() override;
   bool process_events() override;
-  bool ok_to_yield() override;
+  void wait(uint32_t ticket) override;
 
 #ifdef __unix__
  private:
@@ -67,7 +69,7 @@ class UI_SDL2 : public UI {
   ~UI_SDL2();
   bool initialize() override;
   bool process_events() override;
-  bool ok_to_yield() override;
+  void wait(uint32_t ticket) override;
 
  private:
   bool process_game_events();
@@ -12,8 +12,8 @@ UI_SDL2::~UI_SDL2() {
   SDL_Quit();
 }
 
-bool UI_SDL2::ok_to_yield() {
-  return false; // Interactive UI, no sleeping.
+void UI_SDL2::wait(uint32_t /*ticket*/) {
+  // Interactive UI, no sleeping.
 }
 
 bool UI_SDL2::initialize() {
@@ -424,8 +424,29 @@ bool UI_WS::process_events() {
   return ret;
 }
 
-bool UI_WS::ok_to_yield() {
-  return !packet_processed;  // Sleep a while.
+void UI_WS::wait(uint32_t ticket) {
+  if (packet_processed) {
+    return;  // There might be more already.
+  }
+
+  // Sleep until the thin client sends something, the game sends something,
+  // or the frame limiter allows requesting the next frame.
+  auto timeout = Wakeup::FOREVER;
+  if (ok_to_request_frame && frame_acked) {
+    const auto next_request =
+        last_frame_request + std::chrono::duration<float>(1.0f / UI_WS_MAX_FPS);
+    timeout = std::max(
+        std::chrono::ceil<std::chrono::milliseconds>(
+            next_request - std::chrono::steady_clock::now()),
+        std::chrono::milliseconds(1));
+  }
+
+#ifdef __linux__
+  ctx->wakeup->wait(ticket, timeout, ws.socket);
+#else
+  // No eventfd, so the socket can't be waited on along with the wakeup.
+  ctx->wakeup->wait(ticket, std::chrono::milliseconds(1));
+#endif
 }
 
 
@@ -445,8 +466,7 @@ bool UI_WS::process_events() {
   return false;
 }
 
-bool UI_WS::ok_to_yield() {
-  return false;
+void UI_WS::wait(uint32_t /*ticket*/) {
 }
 
 
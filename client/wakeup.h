@@ -0,0 +1,115 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#ifdef __linux__
+#  include <sys/eventfd.h>
+#  include <poll.h>
+#  include <unistd.h>
+#else
+#  include <mutex>
+#  include <condition_variable>
+#endif
+
+// Lets a thread sleep until another thread has something for it (e.g. pushed
+// an event to one of its queues). To not miss a notification that comes
+// between checking for work and going to sleep, take a ticket first:
+//
+//   const uint32_t ticket = wakeup.ticket();
+//   if (!process_stuff()) {
+//     wakeup.wait(ticket, timeout);
+//   }
+//
+// wait() returns right away if notify() was called since the ticket was
+// taken. Only one thread is supposed to wait on a given Wakeup. On Linux it's
+// an eventfd, so the waiting can include another file descriptor too.
+class Wakeup {
+ public:
+  static constexpr std::chrono::milliseconds FOREVER{-1};
+
+  Wakeup() {
+#ifdef __linux__
+    efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+  }
+
+  ~Wakeup() {
+#ifdef __linux__
+    if (efd != -1) {
+      close(efd);
+    }
+#endif
+  }
+
+  Wakeup(const Wakeup&) = delete;
+  Wakeup& operator=(const Wakeup&) = delete;
+
+  uint32_t ticket() const {
+    return seq.load();
+  }
+
+  // Cheap unless the other thread is actually sleeping.
+  void notify() {
+#ifdef __linux__
+    seq.fetch_add(1);
+    if (waiters.load() != 0) {
+      const uint64_t one = 1;
+      (void)!write(efd, &one, sizeof(one));
+    }
+#else
+    {
+      std::lock_guard<std::mutex> lock(m);
+      seq.fetch_add(1);
+    }
+    cv.notify_one();
+#endif
+  }
+
+  // Also returns on timeout (and, rarely, for no reason at all).
+  void wait(uint32_t ticket, std::chrono::milliseconds timeout) {
+#ifdef __linux__
+    wait(ticket, timeout, -1);
+#else
+    std::unique_lock<std::mutex> lock(m);
+    auto notified = [&]{ return seq.load() != ticket; };
+    if (timeout < std::chrono::milliseconds::zero()) {
+      cv.wait(lock, notified);
+    } else {
+      cv.wait_for(lock, timeout, notified);
+    }
+#endif
+  }
+
+#ifdef __linux__
+  // Same as above, but also returns when fd becomes readable.
+  void wait(uint32_t ticket, std::chrono::milliseconds timeout, int fd) {
+    // Either notify() sees the waiter and pokes the eventfd, or the sequence
+    // change is seen here (both are sequentially consistent).
+    waiters.fetch_add(1);
+    if (seq.load() == ticket) {
+      pollfd fds[2] = {
+        { efd, POLLIN, 0 },
+        { fd, POLLIN, 0 }
+      };
+      poll(fds, fd == -1 ? 1 : 2, (int)timeout.count());
+
+      if (fds[0].revents & POLLIN) {
+        uint64_t count;
+        (void)!read(efd, &count, sizeof(count));
+      }
+    }
+    waiters.fetch_sub(1);
+  }
+#endif
+
+ private:
+  std::atomic<uint32_t> seq{0};
+
+#ifdef __linux__
+  std::atomic<int> waiters{0};
+  int efd = -1;
+#else
+  std::mutex m;
+  std::condition_variable cv;
+#endif
+};
@@ -3,6 +3,7 @@
 
 bool WorldMap::load(const std::string& fname) {
   this->tiles.resize(WORLD_SZ);
+  this->revision++;
 
   FILE *f = fopen(fname.c_str(), "rb");
   if (f == nullptr) {
@@ -19,5 +19,9 @@ class WorldMap {
   bool load(const std::string& fname);
 
   std::vector<Tile> tiles;
+
+  // Bumped every time the tiles change, so that anything derived from them
+  // can be invalidated.
+  uint64_t revision = 0;
 };
 